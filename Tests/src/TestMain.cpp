@@ -3,6 +3,20 @@
 #include <atomic>
 #include <vector>
 #include <chrono>
+#include <memory_resource>
+#include <array>
+#include <numeric>
+#include <ctime>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <iterator>
+#include <unordered_map>
+#include <string>
+#include <cstdlib>
+#include <new>
 
 using namespace taskori;
 
@@ -160,6 +174,1484 @@ TEST(SchedulerTest, NestedJobs)
     EXPECT_EQ(counter.load(), 2);
 }
 
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+    std::atomic<int> allocations{ 0 };
+    std::atomic<int> deallocations{ 0 };
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override
+    {
+        deallocations.fetch_add(1, std::memory_order_relaxed);
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+TEST(SchedulerTest, JobEntriesAreRecycled) 
+{
+    CountingResource resource;
+    const unsigned int workers = 4;
+    const int JOB_COUNT = 1000;
+    taskori::Scheduler sched(workers, &resource);
+    std::atomic<int> counter{ 0 };
+
+    for (int round = 0; round < 20; ++round) 
+    {
+        for (int i = 0; i < JOB_COUNT; ++i)
+            sched.Submit([&]() { counter.fetch_add(1, std::memory_order_relaxed); });
+        sched.WaitAll();
+    }
+
+    // Slabs only cover jobs in flight plus what worker caches may hold back
+    const size_t bound = (JOB_COUNT + workers * 2 * Scheduler::PoolBatchSize) / Scheduler::PoolSlabSize + 2;
+    EXPECT_EQ(counter.load(), 20 * JOB_COUNT);
+    EXPECT_GT(resource.allocations.load(), 0);
+    EXPECT_LE(static_cast<size_t>(resource.allocations.load()), bound);
+}
+
+TEST(SchedulerTest, HandlesOutliveScheduler) 
+{
+    CountingResource resource;
+    Task<std::unique_ptr<int>> value;
+    Task<void> dependent;
+    {
+        taskori::Scheduler sched(2, &resource);
+        value = sched.Submit([]() { return std::make_unique<int>(42); });
+        auto blocker = sched.Submit([]() {});
+        dependent = sched.Submit([]() {}, 0, { value, blocker });
+        value.Wait();
+    }
+
+    // The slabs stay until the last handle goes
+    EXPECT_EQ(*value.Get(), 42);
+    EXPECT_EQ(resource.deallocations.load(), 0);
+    dependent.Reset();
+    EXPECT_EQ(resource.deallocations.load(), 0);
+    value.Reset();
+    EXPECT_EQ(resource.deallocations.load(), resource.allocations.load());
+}
+
+TEST(SchedulerTest, HandlesReleasedWhileSchedulerIsDestroyed)
+{
+    CountingResource resource;
+    for (int round = 0; round < 50; round++)
+    {
+        std::vector<Task<int>> tasks;
+        auto sched = std::make_unique<taskori::Scheduler>(2, &resource);
+        for (int i = 0; i < 100; i++)
+            tasks.push_back(sched->Submit([i]() { return i; }));
+        for (auto& task : tasks)
+            task.Wait();
+
+        std::thread releaser([&tasks]() { tasks.clear(); });
+        sched.reset();
+        releaser.join();
+        EXPECT_EQ(resource.deallocations.load(), resource.allocations.load());
+    }
+}
+
+TEST(SchedulerTest, DependencyOnFinishedJob) 
+{
+    taskori::Scheduler sched(2);
+    std::atomic<bool> executed{ false };
+
+    auto first = sched.Submit([]() {});
+    sched.GetFuture(first).wait();
+
+    auto second = sched.Submit([&]() { executed = true; }, 0, { first });
+    sched.GetFuture(second).wait();
+
+    EXPECT_TRUE(executed);
+}
+
+TEST(SchedulerTest, MoveOnlyCaptures) 
+{
+    taskori::Scheduler sched(2);
+    std::atomic<int> result{ 0 };
+
+    auto value = std::make_unique<int>(42);
+    sched.Submit([&result, value = std::move(value)]() { result = *value; });
+    sched.WaitAll();
+
+    EXPECT_EQ(result.load(), 42);
+}
+
+TEST(SchedulerTest, LargeCapturesFallBackToHeap) 
+{
+    taskori::Scheduler sched(2);
+    std::atomic<int> result{ 0 };
+
+    std::array<int, 64> values{};
+    std::iota(values.begin(), values.end(), 0);
+    static_assert(!Scheduler::Job::FitsInline<decltype([values] {})>);
+
+    sched.Submit([&result, values]() { result = std::accumulate(values.begin(), values.end(), 0); });
+    sched.WaitAll();
+
+    EXPECT_EQ(result.load(), 63 * 64 / 2);
+}
+
+TEST(SchedulerTest, SubmitWithArguments) 
+{
+    taskori::Scheduler sched(2);
+    std::atomic<int> result{ 0 };
+
+    auto add = [&result](std::unique_ptr<int> a, int b) { result = *a + b; };
+    sched.Submit(add, std::make_unique<int>(40), 2);
+    sched.WaitAll();
+
+    EXPECT_EQ(result.load(), 42);
+}
+
+TEST(SchedulerTest, IdleWorkersPark) 
+{
+    taskori::Scheduler sched(4);
+    sched.Submit([]() {});
+    sched.WaitAll();
+
+    std::clock_t start = std::clock();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    std::clock_t cpu = std::clock() - start;
+
+    // Parked workers should not burn CPU while nothing is queued
+    EXPECT_LT(cpu * 1000 / CLOCKS_PER_SEC, 20);
+
+    std::atomic<int> counter{ 0 };
+    for (int i = 0; i < 100; ++i)
+        sched.Submit([&]() { counter.fetch_add(1, std::memory_order_relaxed); });
+    sched.WaitAll();
+    EXPECT_EQ(counter.load(), 100);
+}
+
+TEST(SchedulerTest, SubmitBatch) 
+{
+    taskori::Scheduler sched(4);
+    const int JOB_COUNT = 10000;
+    std::atomic<int> counter{ 0 };
+
+    std::vector<Scheduler::Job> jobs;
+    for (int i = 0; i < JOB_COUNT; ++i)
+        jobs.emplace_back([&counter, value = std::make_unique<int>(1)]() { counter.fetch_add(*value, std::memory_order_relaxed); });
+
+    auto handles = sched.SubmitBatch(std::move(jobs), 2);
+    ASSERT_EQ(handles.size(), static_cast<size_t>(JOB_COUNT));
+
+    sched.GetFuture(handles.back()).wait();
+    sched.WaitAll();
+    EXPECT_EQ(counter.load(), JOB_COUNT);
+}
+
+TEST(SchedulerTest, SubmitBatchFewerJobsThanWorkers) 
+{
+    taskori::Scheduler sched(8);
+    std::atomic<int> counter{ 0 };
+
+    std::vector<std::function<void()>> jobs(3, [&counter]() { counter.fetch_add(1, std::memory_order_relaxed); });
+    auto handles = sched.SubmitBatch(jobs);
+    sched.WaitAll();
+
+    EXPECT_EQ(handles.size(), 3u);
+    EXPECT_EQ(counter.load(), 3);
+    EXPECT_TRUE(std::all_of(jobs.begin(), jobs.end(), [](const auto& job) { return static_cast<bool>(job); }));
+    EXPECT_TRUE(sched.SubmitBatch(std::vector<Scheduler::Job>{}).empty());
+}
+
+TEST(SchedulerTest, NestedJobsStayOnSubmittingWorker) 
+{
+    taskori::Scheduler sched(1);
+    std::atomic<int> outerWorker{ -2 };
+    std::atomic<int> innerWorker{ -2 };
+
+    EXPECT_EQ(sched.CurrentWorkerIndex(), -1);
+
+    sched.Submit([&]() 
+        {
+        outerWorker = sched.CurrentWorkerIndex();
+        sched.Submit([&]() { innerWorker = sched.CurrentWorkerIndex(); });
+        });
+    sched.WaitAll();
+
+    EXPECT_EQ(outerWorker.load(), 0);
+    EXPECT_EQ(innerWorker.load(), 0);
+}
+
+TEST(TaskTest, ReturnsResult) 
+{
+    taskori::Scheduler sched(2);
+
+    Task<int> task = sched.Submit([]() { return 6 * 7; });
+    EXPECT_EQ(task.Get(), 42);
+    EXPECT_EQ(task.GetFuture().get(), 42);
+}
+
+TEST(TaskTest, DependentsReadResultsInPlace) 
+{
+    taskori::Scheduler sched(4);
+
+    auto numbers = sched.Submit([]() { return std::vector<int>(1000, 1); });
+    auto sum = sched.Submit([numbers]() 
+        {
+        const std::vector<int>& values = numbers.Get();
+        return std::accumulate(values.begin(), values.end(), 0);
+        }, 0, { numbers });
+
+    EXPECT_EQ(sum.Get(), 1000);
+    EXPECT_EQ(&numbers.Get(), &numbers.Get());
+}
+
+TEST(TaskTest, MoveOnlyResultAndArguments) 
+{
+    taskori::Scheduler sched(2);
+
+    auto task = sched.Submit([](std::unique_ptr<int> value, int extra) 
+        {
+        *value += extra;
+        return value;
+        }, std::make_unique<int>(40), 2);
+
+    std::unique_ptr<int> result = std::move(task.Get());
+    ASSERT_TRUE(result);
+    EXPECT_EQ(*result, 42);
+}
+
+TEST(TaskTest, VoidTaskFuture) 
+{
+    taskori::Scheduler sched(2);
+    std::atomic<bool> executed{ false };
+
+    Task<void> task = sched.Submit([&]() { executed = true; });
+    task.GetFuture().wait();
+    EXPECT_TRUE(task.IsReady());
+    EXPECT_TRUE(executed);
+}
+
+TEST(TaskTest, FutureTypeFollowsTask)
+{
+    taskori::Scheduler sched(2);
+
+    // An untyped handle only yields a completion future
+    Task<double> task = sched.Submit([]() { return 0.5; });
+    Scheduler::JobHandle handle = task;
+    static_assert(std::is_same_v<decltype(Scheduler::GetFuture(handle)), std::future<void>>);
+
+    Scheduler::GetFuture(handle).wait();
+    EXPECT_EQ(task.Get(), 0.5);
+}
+
+TEST(TaskTest, ExceptionIsStoredInTask) 
+{
+    taskori::Scheduler sched(2);
+
+    auto task = sched.Submit([]() -> int { throw std::runtime_error("boom"); });
+    auto future = sched.Submit([]() { throw std::logic_error("bang"); }).GetFuture();
+
+    EXPECT_THROW(task.Get(), std::runtime_error);
+    EXPECT_TRUE(task.HasFailed());
+    EXPECT_THROW(future.get(), std::logic_error);
+    sched.WaitAll();
+}
+
+TEST(TaskTest, FailurePrunesDependents) 
+{
+    taskori::Scheduler sched(4);
+    std::atomic<int> executed{ 0 };
+
+    auto root = sched.Submit([]() { throw std::runtime_error("root failed"); });
+    auto sibling = sched.Submit([&]() { executed.fetch_add(1); });
+    auto child = sched.Submit([&]() { executed.fetch_add(1); }, 0, { root, sibling });
+    auto grandchild = sched.Submit([&]() { executed.fetch_add(1); return 1; }, 0, { child });
+
+    sched.WaitAll();
+
+    EXPECT_EQ(executed.load(), 1); // only the sibling ran
+    EXPECT_TRUE(child.HasFailed());
+    EXPECT_THROW(grandchild.Get(), std::runtime_error);
+    EXPECT_FALSE(sibling.HasFailed());
+
+    // Depending on an already failed job fails immediately as well
+    auto late = sched.Submit([&]() { executed.fetch_add(1); }, 0, { root });
+    EXPECT_THROW(late.Get(), std::runtime_error);
+    EXPECT_EQ(executed.load(), 1);
+}
+
+TEST(TaskTest, FailureSkipsLongChain) 
+{
+    taskori::Scheduler sched(4);
+    const int CHAIN_LENGTH = 50000;
+    std::atomic<int> executed{ 0 };
+
+    Scheduler::JobHandle previous = sched.Submit([]() { throw std::runtime_error("first"); });
+    for (int i = 0; i < CHAIN_LENGTH; ++i)
+        previous = sched.Submit([&]() { executed.fetch_add(1); }, 0, { previous });
+
+    sched.WaitAll();
+    EXPECT_EQ(executed.load(), 0);
+}
+
+TEST(CancellationTest, CancelledJobsAreDropped) 
+{
+    taskori::Scheduler sched(1);
+    CancellationSource source;
+    std::atomic<bool> release{ false };
+    std::atomic<int> executed{ 0 };
+
+    // Keep the only worker busy so everything below is still queued
+    sched.Submit([&]() { while (!release) std::this_thread::yield(); });
+
+    std::vector<Task<int>> tasks;
+    for (int i = 0; i < 100; ++i)
+        tasks.push_back(sched.Submit([&]() { return executed.fetch_add(1); }, 0, {}, source.Token()));
+    auto dependent = sched.Submit([&]() { executed.fetch_add(1); }, 0, { tasks[0] });
+    auto unrelated = sched.Submit([&]() { return 7; });
+
+    source.Cancel();
+    release = true;
+    sched.WaitAll();
+
+    EXPECT_EQ(executed.load(), 0);
+    EXPECT_THROW(tasks[42].Get(), JobCancelled);
+    EXPECT_THROW(dependent.Get(), JobCancelled);
+    EXPECT_EQ(unrelated.Get(), 7);
+}
+
+TEST(CancellationTest, RunningJobPollsToken) 
+{
+    taskori::Scheduler sched(2);
+    CancellationSource source;
+    CancellationToken token = source.Token();
+    std::atomic<bool> started{ false };
+
+    auto task = sched.Submit([token, &started]() 
+        {
+        started = true;
+        int iterations = 0;
+        while (!token.IsCancellationRequested())
+            ++iterations;
+        return iterations;
+        }, 0, {}, token);
+
+    while (!started)
+        std::this_thread::yield();
+    source.Cancel();
+
+    EXPECT_GE(task.Get(), 0);
+    EXPECT_FALSE(CancellationToken().IsCancellationRequested());
+}
+
+static int Fibonacci(Scheduler& sched, int n)
+{
+    if (n < 2)
+        return n;
+
+    auto left = sched.Submit([&sched, n]() { return Fibonacci(sched, n - 1); });
+    int right = Fibonacci(sched, n - 2);
+    return left.Get() + right;
+}
+
+TEST(WaitTest, RecursiveDivideAndConquer) 
+{
+    taskori::Scheduler sched(2);
+
+    auto task = sched.Submit([&sched]() { return Fibonacci(sched, 20); });
+    EXPECT_EQ(task.Get(), 6765);
+}
+
+TEST(WaitTest, SingleWorkerWaitingOnChildDoesNotDeadlock) 
+{
+    taskori::Scheduler sched(1);
+    std::atomic<int> counter{ 0 };
+
+    auto outer = sched.Submit([&]() 
+        {
+        auto inner = sched.Submit([&]() { counter.fetch_add(1); });
+        sched.Wait(inner);
+        return counter.load();
+        });
+
+    sched.Wait(outer);
+    EXPECT_EQ(outer.Get(), 1);
+}
+
+TEST(WaitTest, WaitingWorkerParks) 
+{
+    taskori::Scheduler sched(2);
+    std::atomic<bool> started{ false };
+
+    auto slow = sched.Submit([&]() 
+        {
+        started = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        });
+    // Both waits start once the awaited job runs on the other worker, so the
+    // waiting worker has nothing to help with
+    auto waiter = sched.Submit([&]() 
+        {
+        while (!started)
+            std::this_thread::yield();
+        sched.Wait(slow);
+
+        std::atomic<bool> running{ false };
+        TaskGroup group(sched);
+        group.Run([&]() 
+            {
+            running = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            });
+        while (!running)
+            std::this_thread::yield();
+        group.Wait();
+        });
+
+    while (!started)
+        std::this_thread::yield();
+
+    std::clock_t start = std::clock();
+    waiter.Wait();
+    std::clock_t cpu = std::clock() - start;
+
+    // With nothing else to run, the waiting worker should park, not poll
+    EXPECT_LT(cpu * 1000 / CLOCKS_PER_SEC, 50);
+}
+
+TEST(TaskGroupTest, WaitsOnlyForItsOwnJobs) 
+{
+    taskori::Scheduler sched(2);
+    std::atomic<bool> release{ false };
+    std::atomic<int> counter{ 0 };
+
+    // Unrelated slow work that would keep WaitAll blocked
+    auto slow = sched.Submit([&]() { while (!release) std::this_thread::yield(); });
+
+    TaskGroup group(sched);
+    for (int i = 0; i < 100; ++i)
+        group.Run([&]() { counter.fetch_add(1, std::memory_order_relaxed); });
+    group.Wait();
+
+    EXPECT_EQ(counter.load(), 100);
+    EXPECT_FALSE(slow.IsReady());
+    release = true;
+    sched.WaitAll();
+}
+
+static long SumRange(Scheduler& sched, long begin, long end)
+{
+    if (end - begin <= 64)
+    {
+        long sum = 0;
+        for (long i = begin; i < end; ++i)
+            sum += i;
+        return sum;
+    }
+
+    long middle = begin + (end - begin) / 2;
+    TaskGroup group(sched);
+    auto left = group.Run([&sched, begin, middle]() { return SumRange(sched, begin, middle); });
+    auto right = group.Run([&sched, middle, end]() { return SumRange(sched, middle, end); });
+    group.Wait();
+    return left.Get() + right.Get();
+}
+
+TEST(TaskGroupTest, NestedGroups) 
+{
+    taskori::Scheduler sched(3);
+
+    TaskGroup outer(sched);
+    auto total = outer.Run([&sched]() { return SumRange(sched, 0, 100000); });
+    outer.Wait();
+
+    EXPECT_EQ(total.Get(), 100000L * 99999L / 2);
+}
+
+TEST(TaskGroupTest, WaitRethrowsFirstException) 
+{
+    taskori::Scheduler sched(2);
+    TaskGroup group(sched);
+
+    group.Run([]() {});
+    group.Run([]() { throw std::runtime_error("group failure"); });
+    EXPECT_THROW(group.Wait(), std::runtime_error);
+
+    group.Run([]() {});
+    EXPECT_NO_THROW(group.Wait());
+    EXPECT_TRUE(group.IsIdle());
+}
+
+TEST(TaskGroupTest, DestroyedRightAfterWait) 
+{
+    taskori::Scheduler sched(4);
+    std::atomic<int> counter{ 0 };
+
+    // The last job may still be finishing up when Wait returns on another
+    // thread; it must not touch the group afterwards
+    for (int i = 0; i < 2000; ++i)
+    {
+        auto group = std::make_unique<TaskGroup>(sched);
+        group->Run([&]() { counter.fetch_add(1, std::memory_order_relaxed); });
+        group->Wait();
+        group.reset();
+    }
+
+    EXPECT_EQ(counter.load(), 2000);
+}
+
+template<typename Partitioner>
+static void CheckEveryIndexVisitedOnce(Partitioner partitioner)
+{
+    taskori::Scheduler sched(4);
+    const int COUNT = 100000;
+    std::vector<int> visits(COUNT, 0);
+
+    taskori::ParallelFor(sched, 0, COUNT, [&](int i) { visits[i]++; }, partitioner);
+
+    EXPECT_EQ(std::count(visits.begin(), visits.end(), 1), COUNT);
+}
+
+TEST(ParallelForTest, StaticPartitioner) 
+{
+    CheckEveryIndexVisitedOnce(StaticPartitioner{});
+}
+
+TEST(ParallelForTest, DynamicPartitioner) 
+{
+    CheckEveryIndexVisitedOnce(DynamicPartitioner{});
+    CheckEveryIndexVisitedOnce(DynamicPartitioner{ 7 });
+}
+
+TEST(ParallelForTest, AutoPartitioner) 
+{
+    CheckEveryIndexVisitedOnce(AutoPartitioner{});
+    CheckEveryIndexVisitedOnce(AutoPartitioner{ 1 });
+}
+
+TEST(ParallelForTest, RangeBodyAndEmptyRange) 
+{
+    taskori::Scheduler sched(3);
+    std::atomic<long> total{ 0 };
+
+    taskori::ParallelFor(sched, 10L, 1010L, [&](long first, long last) 
+        {
+        long partial = 0;
+        for (long i = first; i < last; ++i)
+            partial += i;
+        total.fetch_add(partial);
+        });
+    EXPECT_EQ(total.load(), (10L + 1009L) * 1000L / 2);
+
+    bool called = false;
+    taskori::ParallelFor(sched, 5, 5, [&](int) { called = true; });
+    EXPECT_FALSE(called);
+}
+
+TEST(ParallelForTest, NestedInsideJobAndExceptions) 
+{
+    taskori::Scheduler sched(2);
+    std::atomic<int> counter{ 0 };
+
+    auto task = sched.Submit([&]() 
+        {
+        taskori::ParallelFor(sched, 0, 64, [&](int) 
+            {
+            taskori::ParallelFor(sched, 0, 64, [&](int) { counter.fetch_add(1, std::memory_order_relaxed); });
+            });
+        });
+    task.Get();
+    EXPECT_EQ(counter.load(), 64 * 64);
+
+    EXPECT_THROW(taskori::ParallelFor(sched, 0, 1000, [](int i) 
+        {
+        if (i == 500)
+            throw std::runtime_error("body failed");
+        }, DynamicPartitioner{ 10 }), std::runtime_error);
+}
+
+TEST(ReduceTest, SumWithEveryPartitioner) 
+{
+    taskori::Scheduler sched(4);
+    const long long COUNT = 1000000;
+    const long long expected = COUNT * (COUNT - 1) / 2;
+    auto identity = [](long long i) { return i; };
+    auto plus = [](long long a, long long b) { return a + b; };
+
+    EXPECT_EQ(taskori::ParallelReduce(sched, 0LL, COUNT, 0LL, identity, plus), expected);
+    EXPECT_EQ(taskori::ParallelReduce(sched, 0LL, COUNT, 0LL, identity, plus, StaticPartitioner{}), expected);
+    EXPECT_EQ(taskori::ParallelReduce(sched, 0LL, COUNT, 0LL, identity, plus, DynamicPartitioner{ 1000 }), expected);
+    EXPECT_EQ(taskori::ParallelReduce(sched, 5LL, 5LL, 42LL, identity, plus), 42);
+}
+
+TEST(ReduceTest, TransformReduceMinMaxAndHistogram) 
+{
+    taskori::Scheduler sched(3);
+    std::vector<int> values(200000);
+    for (size_t i = 0; i < values.size(); i++)
+        values[i] = static_cast<int>((i * 7919) % 100003) - 50000;
+
+    int maxValue = taskori::TransformReduce(sched, values.begin(), values.end(), INT_MIN,
+        [](int a, int b) { return std::max(a, b); }, [](int v) { return v; });
+    EXPECT_EQ(maxValue, *std::max_element(values.begin(), values.end()));
+
+    long long sumOfSquares = taskori::TransformReduce(sched, values.begin(), values.end(), 0LL,
+        std::plus<>(), [](int v) { return static_cast<long long>(v) * v; });
+    long long expectedSquares = 0;
+    for (int v : values)
+        expectedSquares += static_cast<long long>(v) * v;
+    EXPECT_EQ(sumOfSquares, expectedSquares);
+
+    using Histogram = std::array<int, 16>;
+    Histogram histogram = taskori::ParallelReduce(sched, size_t(0), values.size(), Histogram{},
+        [&](size_t i) 
+        {
+            Histogram h{};
+            h[static_cast<unsigned>(values[i]) % 16]++;
+            return h;
+        },
+        [](Histogram a, const Histogram& b) 
+        {
+            for (size_t i = 0; i < a.size(); i++)
+                a[i] += b[i];
+            return a;
+        });
+    Histogram expectedHistogram{};
+    for (int v : values)
+        expectedHistogram[static_cast<unsigned>(v) % 16]++;
+    EXPECT_EQ(histogram, expectedHistogram);
+
+    std::vector<int> empty;
+    EXPECT_EQ(taskori::TransformReduce(sched, empty.begin(), empty.end(), 7, std::plus<>(), [](int v) { return v; }), 7);
+}
+
+TEST(ReduceTest, DeterministicAcrossWorkerCounts) 
+{
+    std::vector<double> values(300000);
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<double> mantissa(-1.0, 1.0);
+    std::uniform_int_distribution<int> exponent(-30, 30);
+    for (double& v : values)
+        v = std::ldexp(mantissa(rng), exponent(rng));
+
+    // Affine maps x -> a * x + b under composition: associative but not commutative
+    struct Affine { long long a, b; };
+    const long long MOD = 1000000007;
+    auto compose = [MOD](Affine f, Affine g) { return Affine{ f.a * g.a % MOD, (f.b * g.a + g.b) % MOD }; };
+    auto affineOf = [](int i) { return Affine{ i % 7 + 2, i % 13 }; };
+    Affine expectedAffine{ 1, 0 };
+    for (int i = 0; i < 50000; i++)
+        expectedAffine = compose(expectedAffine, affineOf(i));
+
+    std::vector<double> sums;
+    for (unsigned workers : { 1u, 2u, 8u, 32u })
+    {
+        taskori::Scheduler sched(workers);
+        sums.push_back(taskori::TransformReduce(sched, values.begin(), values.end(), 0.0,
+            std::plus<>(), [](double v) { return v; }, DeterministicPartitioner{}));
+        for (int repeat = 0; repeat < 3; repeat++)
+        {
+            double again = taskori::TransformReduce(sched, values.begin(), values.end(), 0.0,
+                std::plus<>(), [](double v) { return v; }, DeterministicPartitioner{});
+            EXPECT_EQ(std::memcmp(&again, &sums.back(), sizeof(double)), 0);
+        }
+
+        Affine result = taskori::ParallelReduce(sched, 0, 50000, Affine{ 1, 0 }, affineOf, compose, DeterministicPartitioner{ 100 });
+        EXPECT_EQ(result.a, expectedAffine.a);
+        EXPECT_EQ(result.b, expectedAffine.b);
+    }
+
+    for (double sum : sums)
+        EXPECT_EQ(std::memcmp(&sum, &sums[0], sizeof(double)), 0);
+    EXPECT_NEAR(sums[0], std::accumulate(values.begin(), values.end(), 0.0), 1e-3);
+}
+
+TEST(ScanTest, MatchesStandardScans) 
+{
+    taskori::Scheduler sched(4);
+    for (size_t count : { size_t(0), size_t(1), size_t(1000), size_t(1000000) })
+    {
+        std::vector<long long> input(count);
+        for (size_t i = 0; i < count; i++)
+            input[i] = static_cast<long long>((i * 31) % 17) - 8;
+
+        std::vector<long long> expected(count), actual(count);
+        std::inclusive_scan(input.begin(), input.end(), expected.begin());
+        EXPECT_EQ(taskori::ParallelInclusiveScan(sched, input.begin(), input.end(), actual.begin()), actual.end());
+        EXPECT_EQ(actual, expected);
+
+        std::exclusive_scan(input.begin(), input.end(), expected.begin(), 100LL);
+        taskori::ParallelExclusiveScan(sched, input.begin(), input.end(), actual.begin(), 100LL);
+        EXPECT_EQ(actual, expected);
+
+        auto maxOp = [](long long a, long long b) { return std::max(a, b); };
+        std::inclusive_scan(input.begin(), input.end(), expected.begin(), maxOp, -5LL);
+        taskori::ParallelInclusiveScan(sched, input.begin(), input.end(), actual.begin(), maxOp, -5LL);
+        EXPECT_EQ(actual, expected);
+    }
+}
+
+TEST(ScanTest, InPlaceAndSingleWorker) 
+{
+    std::vector<int> input(300000);
+    for (size_t i = 0; i < input.size(); i++)
+        input[i] = static_cast<int>(i % 5);
+    std::vector<int> expected(input.size());
+    std::exclusive_scan(input.begin(), input.end(), expected.begin(), 0);
+
+    for (unsigned workers : { 1u, 3u })
+    {
+        taskori::Scheduler sched(workers);
+        std::vector<int> data = input;
+        taskori::ParallelExclusiveScan(sched, data.begin(), data.end(), data.begin(), 0);
+        EXPECT_EQ(data, expected);
+    }
+}
+
+TEST(SortTest, MatchesStdSort) 
+{
+    taskori::Scheduler sched(4);
+    std::mt19937 rng(42);
+    for (size_t count : { size_t(0), size_t(1), size_t(5000), size_t(500000) })
+    {
+        std::vector<int> values(count);
+        for (int& v : values)
+            v = static_cast<int>(rng() % 100000);
+        std::vector<int> expected = values;
+
+        std::sort(expected.begin(), expected.end());
+        taskori::ParallelSort(sched, values.begin(), values.end());
+        EXPECT_EQ(values, expected);
+
+        std::sort(expected.begin(), expected.end(), std::greater<>());
+        taskori::ParallelSort(sched, values.begin(), values.end(), std::greater<>());
+        EXPECT_EQ(values, expected);
+    }
+}
+
+TEST(SortTest, StableKeepsOrderOfEqualKeys) 
+{
+    struct Record { std::uint64_t key; std::uint64_t payload; };
+    std::vector<Record> records(300000);
+    std::mt19937 rng(7);
+    for (size_t i = 0; i < records.size(); i++)
+        records[i] = Record{ rng() % 64, i };
+
+    auto byKey = [](const Record& a, const Record& b) { return a.key < b.key; };
+    std::vector<Record> expected = records;
+    std::stable_sort(expected.begin(), expected.end(), byKey);
+
+    taskori::Scheduler sched(3);
+    taskori::ParallelStableSort(sched, records.begin(), records.end(), byKey);
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        ASSERT_EQ(records[i].key, expected[i].key);
+        ASSERT_EQ(records[i].payload, expected[i].payload);
+    }
+}
+
+TEST(SortTest, MoveOnlyElementsFromInsideJob) 
+{
+    taskori::Scheduler sched(2);
+    std::vector<std::unique_ptr<int>> values;
+    for (int i = 0; i < 50000; i++)
+        values.push_back(std::make_unique<int>((i * 7919) % 50000));
+
+    auto task = sched.Submit([&]() 
+        {
+        taskori::ParallelSort(sched, values.begin(), values.end(),
+            [](const std::unique_ptr<int>& a, const std::unique_ptr<int>& b) { return *a < *b; });
+        });
+    task.Get();
+
+    for (int i = 0; i < 50000; i++)
+        ASSERT_EQ(*values[i], i);
+}
+
+TEST(FilterTest, CopyIfKeepsOrder) 
+{
+    std::vector<int> input(1000000);
+    for (size_t i = 0; i < input.size(); i++)
+        input[i] = static_cast<int>((i * 2654435761u) % 1000);
+    auto isSmall = [](int v) { return v < 300; };
+
+    std::vector<int> expected;
+    std::copy_if(input.begin(), input.end(), std::back_inserter(expected), isSmall);
+
+    for (unsigned workers : { 1u, 4u })
+    {
+        taskori::Scheduler sched(workers);
+        std::vector<int> output(input.size());
+        auto end = taskori::ParallelCopyIf(sched, input.begin(), input.end(), output.begin(), isSmall);
+        output.erase(end, output.end());
+        EXPECT_EQ(output, expected);
+    }
+
+    taskori::Scheduler sched(2);
+    std::vector<int> none(input.size());
+    EXPECT_EQ(taskori::ParallelCopyIf(sched, input.begin(), input.end(), none.begin(), [](int) { return false; }), none.begin());
+}
+
+TEST(FilterTest, PartitionMatchesStablePartition) 
+{
+    std::vector<std::pair<int, int>> input(500000);
+    for (size_t i = 0; i < input.size(); i++)
+        input[i] = { static_cast<int>((i * 7919) % 101), static_cast<int>(i) };
+    auto isOdd = [](const std::pair<int, int>& p) { return p.first % 2 != 0; };
+
+    std::vector<std::pair<int, int>> expected = input;
+    auto expectedPoint = std::stable_partition(expected.begin(), expected.end(), isOdd) - expected.begin();
+
+    taskori::Scheduler sched(3);
+    auto point = taskori::ParallelPartition(sched, input.begin(), input.end(), isOdd) - input.begin();
+    EXPECT_EQ(point, expectedPoint);
+    EXPECT_EQ(input, expected);
+}
+
+TEST(FindTest, FindsFirstMatch) 
+{
+    taskori::Scheduler sched(4);
+    std::vector<int> values(2000000, 0);
+    values[1234567] = 1;
+    values[1500000] = 1;
+    values[1999999] = 1;
+
+    auto isOne = [](int v) { return v == 1; };
+    EXPECT_EQ(taskori::ParallelFindIf(sched, values.begin(), values.end(), isOne) - values.begin(), 1234567);
+    EXPECT_TRUE(taskori::ParallelAnyOf(sched, values.begin(), values.end(), isOne));
+
+    auto isTwo = [](int v) { return v == 2; };
+    EXPECT_EQ(taskori::ParallelFindIf(sched, values.begin(), values.end(), isTwo), values.end());
+    EXPECT_FALSE(taskori::ParallelAnyOf(sched, values.begin(), values.end(), isTwo));
+    EXPECT_EQ(taskori::ParallelFindIf(sched, values.begin(), values.begin(), isOne), values.begin());
+}
+
+TEST(FindTest, StopsEarlyOnMatchNearFront) 
+{
+    taskori::Scheduler sched(4);
+    std::vector<int> values(10000000, 0);
+    values[10] = 1;
+
+    std::atomic<size_t> evaluations{ 0 };
+    auto isOne = [&](int v) 
+        {
+        evaluations.fetch_add(1, std::memory_order_relaxed);
+        return v == 1;
+        };
+
+    EXPECT_EQ(taskori::ParallelFindIf(sched, values.begin(), values.end(), isOne) - values.begin(), 10);
+    EXPECT_LT(evaluations.load(), values.size() / 10);
+
+    evaluations = 0;
+    EXPECT_TRUE(taskori::ParallelAnyOf(sched, values.begin(), values.end(), isOne));
+    EXPECT_LT(evaluations.load(), values.size() / 10);
+}
+
+TEST(GroupByTest, SumsPerKey) 
+{
+    std::vector<int> rows(1000000);
+    for (size_t i = 0; i < rows.size(); i++)
+        rows[i] = static_cast<int>((i * 2654435761u) % 100000);
+
+    std::unordered_map<int, long long> expected;
+    for (int row : rows)
+        expected[row % 1000] += row;
+
+    for (unsigned workers : { 1u, 4u })
+    {
+        taskori::Scheduler sched(workers);
+        auto result = taskori::ParallelGroupBy(sched, rows.begin(), rows.end(),
+            [](int row) { return row % 1000; },
+            [](int row) { return static_cast<long long>(row); },
+            std::plus<>());
+
+        ASSERT_EQ(result.groups.size(), expected.size());
+        for (auto& [key, sum] : result.groups)
+            EXPECT_EQ(sum, expected.at(key));
+
+        EXPECT_GT(result.stats.partitions, 0u);
+        EXPECT_GT(result.stats.localTableBytes, 0u);
+        EXPECT_GT(result.stats.mergedTableBytes, 0u);
+        EXPECT_EQ(result.stats.resultBytes, result.groups.capacity() * sizeof(result.groups[0]));
+    }
+}
+
+TEST(GroupByTest, StringKeysAndEmptyInput) 
+{
+    taskori::Scheduler sched(3);
+    std::vector<std::string> words;
+    for (int i = 0; i < 50000; i++)
+        words.push_back("word" + std::to_string(i % 37));
+
+    auto result = taskori::ParallelGroupBy(sched, words.begin(), words.end(),
+        [](const std::string& w) { return w; },
+        [](const std::string&) { return 1; },
+        std::plus<>());
+    ASSERT_EQ(result.groups.size(), 37u);
+    int total = 0;
+    for (auto& [word, count] : result.groups)
+    {
+        int id = std::stoi(word.substr(4));
+        EXPECT_EQ(count, 50000 / 37 + (id < 50000 % 37 ? 1 : 0));
+        total += count;
+    }
+    EXPECT_EQ(total, 50000);
+
+    std::vector<std::string> none;
+    auto empty = taskori::ParallelGroupBy(sched, none.begin(), none.end(),
+        [](const std::string& w) { return w; }, [](const std::string&) { return 1; }, std::plus<>());
+    EXPECT_TRUE(empty.groups.empty());
+}
+
+TEST(ParallelFor2DTest, VisitsEveryPointOnce) 
+{
+    taskori::Scheduler sched(4);
+    const int WIDTH = 517, HEIGHT = 263;
+
+    for (Tile2D tile : { Tile2D{}, Tile2D{ 32, 8 }, Tile2D{ 1000, 1 } })
+    {
+        std::vector<int> visits(WIDTH * HEIGHT, 0);
+        taskori::ParallelFor2D(sched, 0, WIDTH, 0, HEIGHT, [&](int x, int y) { visits[y * WIDTH + x]++; }, tile);
+        EXPECT_EQ(std::count(visits.begin(), visits.end(), 1), WIDTH * HEIGHT);
+    }
+
+    std::atomic<long> covered{ 0 };
+    taskori::ParallelFor2D(sched, 10, 20, 5, 8, [&](int x0, int x1, int y0, int y1) 
+        {
+        EXPECT_LE(10, x0);
+        EXPECT_LE(x1, 20);
+        EXPECT_LE(5, y0);
+        EXPECT_LE(y1, 8);
+        covered.fetch_add(static_cast<long>(x1 - x0) * (y1 - y0));
+        });
+    EXPECT_EQ(covered.load(), 30);
+}
+
+TEST(ParallelFor2DTest, TilesRunInMortonOrder) 
+{
+    taskori::Scheduler sched(1);
+    std::vector<std::pair<int, int>> order;
+    taskori::ParallelFor2D(sched, 0, 64, 0, 64, [&](int x0, int, int y0, int) { order.push_back({ x0 / 16, y0 / 16 }); }, Tile2D{ 16, 16 });
+
+    std::vector<std::pair<int, int>> expected = { { 0, 0 }, { 1, 0 }, { 0, 1 }, { 1, 1 }, { 2, 0 }, { 3, 0 }, { 2, 1 }, { 3, 1 } };
+    ASSERT_EQ(order.size(), 16u);
+    EXPECT_TRUE(std::equal(expected.begin(), expected.end(), order.begin()));
+}
+
+TEST(ParallelFor3DTest, VisitsEveryPointOnce) 
+{
+    taskori::Scheduler sched(3);
+    const int X = 37, Y = 29, Z = 23;
+    std::vector<int> visits(X * Y * Z, 0);
+
+    taskori::ParallelFor3D(sched, 0, X, 0, Y, 0, Z, [&](int x, int y, int z) { visits[(z * Y + y) * X + x]++; });
+    EXPECT_EQ(std::count(visits.begin(), visits.end(), 1), X * Y * Z);
+
+    std::atomic<long> covered{ 0 };
+    taskori::ParallelFor3D(sched, 0, X, 0, Y, 0, Z, [&](int x0, int x1, int y0, int y1, int z0, int z1) 
+        {
+        covered.fetch_add(static_cast<long>(x1 - x0) * (y1 - y0) * (z1 - z0));
+        }, Tile3D{ 4, 4, 4 });
+    EXPECT_EQ(covered.load(), X * Y * Z);
+}
+
+TEST(AffinityTest, RepeatedLoopsVisitEveryIndexOnce) 
+{
+    taskori::Scheduler sched(4);
+    taskori::AffinityPartitioner affinity;
+    std::vector<int> values(100000, 0);
+
+    for (int frame = 0; frame < 10; frame++)
+        taskori::ParallelFor(sched, size_t(0), values.size(), [&](size_t i) { values[i]++; }, affinity);
+    EXPECT_EQ(std::count(values.begin(), values.end(), 10), static_cast<long>(values.size()));
+
+    // A different range size or scheduler restarts the mapping
+    taskori::ParallelFor(sched, size_t(0), size_t(777), [&](size_t i) { values[i]++; }, affinity);
+    taskori::Scheduler other(2);
+    taskori::ParallelFor(other, size_t(0), values.size(), [&](size_t i) { values[i]++; }, affinity);
+    EXPECT_EQ(std::count(values.begin(), values.begin() + 777, 12), 777);
+    EXPECT_EQ(std::count(values.begin() + 777, values.end(), 11), static_cast<long>(values.size() - 777));
+}
+
+TEST(AffinityTest, PlacementIsReplayedAndStaysSpread) 
+{
+    const unsigned int workers = 4;
+    taskori::Scheduler sched(workers);
+    taskori::AffinityPartitioner affinity(1000); // 16 chunks
+    auto frame = [&]() 
+        {
+        taskori::ParallelFor(sched, 0, 16000, [](int, int) { std::this_thread::sleep_for(std::chrono::milliseconds(1)); }, affinity);
+        };
+    std::vector<int> loads(workers);
+    auto countLoads = [&]() 
+        {
+        std::fill(loads.begin(), loads.end(), 0);
+        for (unsigned int worker : affinity.Placement())
+            loads[worker]++;
+        };
+
+    // Every worker runs some of its chunks, so whatever gets stolen stays put
+    frame();
+    const std::vector<unsigned int> placement = affinity.Placement();
+    for (int run = 0; run < 10; run++)
+        frame();
+    EXPECT_EQ(affinity.Placement(), placement);
+    countLoads();
+    EXPECT_LE(*std::max_element(loads.begin(), loads.end()), 5);
+
+    // Three workers busy for a whole loop: the free one runs every chunk but
+    // only takes over one chunk beyond its share
+    std::atomic<int> blocked{ 0 };
+    std::atomic<bool> release{ false };
+    std::vector<int> busy(workers, 0);
+    taskori::TaskGroup blockers(sched);
+    for (unsigned int worker = 1; worker < workers; worker++)
+    {
+        blockers.RunOn(worker, [&]() 
+            {
+            busy[sched.CurrentWorkerIndex()] = 1;
+            blocked++;
+            while (!release)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            });
+    }
+    while (blocked < 3)
+        std::this_thread::yield();
+
+    frame();
+    const int free = static_cast<int>(std::find(busy.begin(), busy.end(), 0) - busy.begin());
+    countLoads();
+    EXPECT_EQ(loads[free], 5);
+    EXPECT_LE(*std::max_element(loads.begin(), loads.end()), 5);
+
+    release = true;
+    blockers.Wait();
+}
+
+TEST(AffinityTest, RunOnFromWorkerAndExternalThread) 
+{
+    taskori::Scheduler sched(3);
+    taskori::TaskGroup group(sched);
+    std::atomic<int> ran{ 0 };
+
+    for (unsigned int worker = 0; worker < 3; worker++)
+        group.RunOn(worker, [&]() { ran++; });
+    group.Run([&]() 
+        {
+        taskori::TaskGroup inner(sched);
+        for (unsigned int worker = 0; worker < 3; worker++)
+            inner.RunOn(worker, [&]() { ran++; });
+        inner.Wait();
+        });
+    group.Wait();
+    EXPECT_EQ(ran.load(), 6);
+}
+
+// Counts every allocation made through the global operator new
+static std::atomic<size_t> g_HeapAllocations{ 0 };
+
+void* operator new(size_t size)
+{
+    g_HeapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    g_HeapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+// GCC can't tell these replace the global operators, so it flags the free
+// of memory that new expressions got from operator new above
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// Layers of nodes, each depending on two nodes of the previous layer
+static void BuildLayeredGraph(taskori::TaskGraph& graph, int layers, int width, std::vector<std::atomic<int>>& stamps,
+    std::atomic<int>& clock, std::vector<std::pair<size_t, size_t>>& edges)
+{
+    for (int i = 0; i < layers * width; i++)
+        graph.AddNode([&stamps, &clock, i]() { stamps[i] = clock.fetch_add(1); });
+
+    for (int layer = 1; layer < layers; layer++)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            size_t node = layer * width + i;
+            for (int parent : { i, (i + 1) % width })
+            {
+                edges.push_back({ (layer - 1) * width + parent, node });
+                graph.AddEdge(edges.back().first, edges.back().second);
+            }
+        }
+    }
+}
+
+TEST(TaskGraphTest, RunsInDependencyOrderRepeatedly) 
+{
+    taskori::Scheduler sched(4);
+    taskori::TaskGraph graph;
+    std::vector<std::atomic<int>> stamps(40 * 50);
+    std::atomic<int> clock{ 0 };
+    std::vector<std::pair<size_t, size_t>> edges;
+    BuildLayeredGraph(graph, 40, 50, stamps, clock, edges);
+
+    graph.Freeze();
+    EXPECT_EQ(graph.NodeCount(), 2000u);
+    EXPECT_EQ(graph.EdgeCount(), edges.size());
+
+    for (int run = 0; run < 5; run++)
+    {
+        clock = 0;
+        sched.Run(graph);
+        EXPECT_EQ(clock.load(), 2000);
+        for (auto& [before, after] : edges)
+            ASSERT_LT(stamps[before].load(), stamps[after].load());
+    }
+}
+
+TEST(TaskGraphTest, SteadyStateRunsDoNotAllocate) 
+{
+    taskori::Scheduler sched(4);
+    taskori::TaskGraph graph;
+    std::vector<std::atomic<int>> stamps(20 * 100);
+    std::atomic<int> clock{ 0 };
+    std::vector<std::pair<size_t, size_t>> edges;
+    BuildLayeredGraph(graph, 20, 100, stamps, clock, edges);
+
+    // The first run freezes the graph and reserves queue space on every
+    // worker, whichever of them end up running its nodes later
+    sched.Run(graph);
+
+    size_t before = g_HeapAllocations.load();
+    for (int run = 0; run < 50; run++)
+        sched.Run(graph);
+    EXPECT_EQ(g_HeapAllocations.load(), before);
+    EXPECT_EQ(clock.load(), 51 * 2000);
+}
+
+TEST(TaskGraphTest, FailuresSkipDependents) 
+{
+    taskori::Scheduler sched(2);
+    taskori::TaskGraph graph;
+    std::atomic<bool> shouldThrow{ true };
+    std::atomic<int> dependentRuns{ 0 }, independentRuns{ 0 };
+
+    auto failing = graph.AddNode([&]() 
+        {
+        if (shouldThrow)
+            throw std::runtime_error("node failed");
+        });
+    auto child = graph.AddNode([&]() { dependentRuns++; });
+    auto grandChild = graph.AddNode([&]() { dependentRuns++; });
+    graph.AddNode([&]() { independentRuns++; });
+    graph.AddEdge(failing, child);
+    graph.AddEdge(child, grandChild);
+
+    EXPECT_THROW(sched.Run(graph), std::runtime_error);
+    EXPECT_EQ(dependentRuns.load(), 0);
+    EXPECT_EQ(independentRuns.load(), 1);
+
+    shouldThrow = false;
+    sched.Run(graph);
+    EXPECT_EQ(dependentRuns.load(), 2);
+    EXPECT_EQ(independentRuns.load(), 2);
+}
+
+TEST(TaskGraphTest, RejectsCyclesAndChangesAfterFreeze) 
+{
+    taskori::TaskGraph cyclic;
+    auto a = cyclic.AddNode([] {});
+    auto b = cyclic.AddNode([] {});
+    auto c = cyclic.AddNode([] {});
+    cyclic.AddEdge(a, b);
+    cyclic.AddEdge(b, c);
+    cyclic.AddEdge(c, b);
+    EXPECT_THROW(cyclic.Freeze(), std::logic_error);
+    EXPECT_THROW(cyclic.AddEdge(a, a), std::invalid_argument);
+
+    taskori::TaskGraph graph;
+    graph.AddNode([] {});
+    graph.Freeze();
+    EXPECT_THROW(graph.AddNode([] {}), std::logic_error);
+}
+
+TEST(TaskGraphTest, RunFromInsideJob) 
+{
+    taskori::Scheduler sched(2);
+    taskori::TaskGraph graph;
+    std::atomic<int> count{ 0 };
+    auto first = graph.AddNode([&]() { count++; });
+    for (int i = 0; i < 10; i++)
+        graph.AddEdge(first, graph.AddNode([&]() { count++; }));
+
+    auto task = sched.Submit([&]() 
+        {
+        for (int run = 0; run < 3; run++)
+            sched.Run(graph);
+        });
+    task.Get();
+    sched.WaitAll();
+    EXPECT_EQ(count.load(), 33);
+}
+
+TEST(TaskGraphTest, DestroyedRightAfterRun) 
+{
+    taskori::Scheduler sched(4);
+    std::atomic<int> count{ 0 };
+
+    // The node finishing a run must not touch the graph once Run returns
+    for (int i = 0; i < 1000; i++)
+    {
+        auto graph = std::make_unique<taskori::TaskGraph>();
+        graph->AddEdge(graph->AddNode([&]() { count++; }), graph->AddNode([&]() { count++; }));
+        sched.Run(*graph);
+        graph.reset();
+    }
+
+    EXPECT_EQ(count.load(), 2000);
+}
+
+TEST(CompactTaskGraphTest, RunsFromCompactLayout) 
+{
+    taskori::Scheduler sched(4);
+    const uint32_t LAYERS = 100, WIDTH = 1000;
+    std::vector<std::atomic<int>> stamps(LAYERS * WIDTH);
+    std::atomic<int> clock{ 0 };
+    taskori::CompactTaskGraph graph(LAYERS * WIDTH, [&](uint32_t node) { stamps[node] = clock.fetch_add(1); });
+
+    graph.ReserveEdges(size_t(LAYERS - 1) * WIDTH * 2);
+    for (uint32_t layer = 1; layer < LAYERS; layer++)
+    {
+        for (uint32_t i = 0; i < WIDTH; i++)
+        {
+            graph.AddEdge((layer - 1) * WIDTH + i, layer * WIDTH + i);
+            graph.AddEdge((layer - 1) * WIDTH + (i + 1) % WIDTH, layer * WIDTH + i);
+        }
+    }
+    graph.Freeze();
+    EXPECT_EQ(graph.EdgeCount(), size_t(LAYERS - 1) * WIDTH * 2);
+
+    // 32-byte node states plus 32-bit offsets, in-degrees, successors and roots
+    EXPECT_LE(graph.MemoryBytes(), graph.NodeCount() * 48 + graph.EdgeCount() * 4);
+
+    for (int run = 0; run < 3; run++)
+    {
+        clock = 0;
+        sched.Run(graph);
+        EXPECT_EQ(clock.load(), static_cast<int>(LAYERS * WIDTH));
+        for (uint32_t node = WIDTH; node < LAYERS * WIDTH; node++)
+        {
+            uint32_t parent = node - WIDTH;
+            uint32_t neighbour = node - node % WIDTH + (node + 1) % WIDTH - WIDTH;
+            ASSERT_LT(stamps[parent].load(), stamps[node].load());
+            ASSERT_LT(stamps[neighbour].load(), stamps[node].load());
+        }
+    }
+}
+
+TEST(CompactTaskGraphTest, FailuresSkipDependentsAndCyclesAreRejected) 
+{
+    taskori::Scheduler sched(2);
+    std::vector<std::atomic<int>> runs(4);
+    taskori::CompactTaskGraph graph(4, [&](uint32_t node) 
+        {
+        runs[node]++;
+        if (node == 0)
+            throw std::runtime_error("node failed");
+        });
+    graph.AddEdge(0, 1);
+    graph.AddEdge(1, 2);
+    EXPECT_THROW(graph.AddEdge(0, 4), std::invalid_argument);
+
+    EXPECT_THROW(sched.Run(graph), std::runtime_error);
+    EXPECT_EQ(runs[0].load(), 1);
+    EXPECT_EQ(runs[1].load(), 0);
+    EXPECT_EQ(runs[2].load(), 0);
+    EXPECT_EQ(runs[3].load(), 1);
+
+    taskori::CompactTaskGraph cyclic(3, [](uint32_t) {});
+    cyclic.AddEdge(0, 1);
+    cyclic.AddEdge(1, 2);
+    cyclic.AddEdge(2, 1);
+    EXPECT_THROW(cyclic.Freeze(), std::logic_error);
+}
+
+TEST(TaskGraphOptimizeTest, ReducesDropsAndFusesEquivalently) 
+{
+    taskori::Scheduler sched(3);
+    taskori::TaskGraph graph;
+    std::vector<std::atomic<int>> stamps(8);
+    std::atomic<int> clock{ 0 };
+    std::atomic<bool> shouldThrow{ false };
+    auto stamp = [&](int node) 
+        {
+        return [&stamps, &clock, &shouldThrow, node]() 
+            {
+            if (node == 1 && shouldThrow)
+                throw std::runtime_error("node failed");
+            stamps[node] = ++clock;
+            };
+        };
+
+    // A -> B -> C -> D -> E -> (empty) -> F <- G, plus A -> C and a duplicate A -> B
+    std::vector<taskori::TaskGraph::NodeId> ids;
+    for (int node = 0; node < 5; node++)
+        ids.push_back(graph.AddNode(stamp(node)));
+    auto empty = graph.AddEmptyNode();
+    auto f = graph.AddNode(stamp(5));
+    auto g = graph.AddNode(stamp(6));
+    for (int node = 0; node < 4; node++)
+        graph.AddEdge(ids[node], ids[node + 1]);
+    graph.AddEdge(ids[0], ids[2]);
+    graph.AddEdge(ids[0], ids[1]);
+    graph.AddEdge(ids[4], empty);
+    graph.AddEdge(empty, f);
+    graph.AddEdge(g, f);
+
+    taskori::GraphOptimizeReport report = graph.Optimize();
+    EXPECT_EQ(report.nodesBefore, 8u);
+    EXPECT_EQ(report.edgesBefore, 9u);
+    EXPECT_EQ(report.nodesAfter, 3u); // A..E fused, F, G
+    EXPECT_EQ(report.edgesAfter, 2u);
+    EXPECT_TRUE(graph.IsFrozen());
+    EXPECT_EQ(graph.NodeCount(), 3u);
+
+    sched.Run(graph);
+    for (int node = 0; node < 5; node++)
+        EXPECT_LT(stamps[node].load(), stamps[node + 1].load());
+    EXPECT_LT(stamps[6].load(), stamps[5].load());
+
+    // A failure inside the fused chain still skips the rest and F
+    for (auto& value : stamps)
+        value = 0;
+    shouldThrow = true;
+    EXPECT_THROW(sched.Run(graph), std::runtime_error);
+    EXPECT_NE(stamps[0].load(), 0);
+    EXPECT_EQ(stamps[2].load(), 0);
+    EXPECT_EQ(stamps[5].load(), 0);
+    EXPECT_NE(stamps[6].load(), 0);
+}
+
+TEST(TaskGraphOptimizeTest, KeepsBarriersThatSaveEdges) 
+{
+    taskori::Scheduler sched(2);
+    std::atomic<int> before{ 0 }, after{ 0 };
+    bool ordered = true;
+    std::mutex mutex;
+
+    for (bool optimize : { true, false })
+    {
+        taskori::TaskGraph graph;
+        auto barrier = graph.AddEmptyNode();
+        for (int i = 0; i < 3; i++)
+        {
+            graph.AddEdge(graph.AddNode([&]() { before++; }), barrier);
+            graph.AddEdge(barrier, graph.AddNode([&]() 
+                {
+                std::lock_guard<std::mutex> lock(mutex);
+                ordered = ordered && before.load() % 3 == 0;
+                after++;
+                }));
+        }
+
+        taskori::GraphOptimizeOptions options;
+        if (!optimize)
+            options = { false, false, false };
+        taskori::GraphOptimizeReport report = graph.Optimize(options);
+        EXPECT_EQ(report.nodesAfter, 7u);
+        EXPECT_EQ(report.edgesAfter, 6u);
+
+        sched.Run(graph);
+    }
+    EXPECT_EQ(after.load(), 6);
+    EXPECT_TRUE(ordered);
+}
+
+// 0 fans out to 1 and 2, which join in 3, then 4
+static constexpr std::array<taskori::StaticEdge, 5> DIAMOND_PIPELINE{ { { 0, 1 }, { 0, 2 }, { 1, 3 }, { 2, 3 }, { 3, 4 } } };
+
+TEST(StaticGraphTest, RunsInOrderWithoutAllocating) 
+{
+    taskori::Scheduler sched(3);
+    std::array<std::atomic<int>, 5> stamps{};
+    std::atomic<int> clock{ 0 };
+    auto stamp = [&](int node) { return [&stamps, &clock, node]() { stamps[node] = ++clock; }; };
+
+    auto graph = taskori::MakeStaticGraph<DIAMOND_PIPELINE>(stamp(0), stamp(1), stamp(2), stamp(3), stamp(4));
+    static_assert(decltype(graph)::NodeCount() == 5 && decltype(graph)::EdgeCount() == 5);
+
+    auto checkOrder = [&]() 
+        {
+        for (auto& edge : DIAMOND_PIPELINE)
+            ASSERT_LT(stamps[edge.before].load(), stamps[edge.after].load());
+        };
+
+    // Not even the first run allocates, whichever worker gets the root
+    size_t before = g_HeapAllocations.load();
+    for (int run = 0; run < 100; run++)
+        sched.Run(graph);
+    EXPECT_EQ(g_HeapAllocations.load(), before);
+    EXPECT_EQ(clock.load(), 100 * 5);
+    checkOrder();
+
+    sched.Submit([&]() { sched.Run(graph); }).Get();
+    EXPECT_EQ(clock.load(), 101 * 5);
+    checkOrder();
+}
+
+TEST(StaticGraphTest, FailuresSkipDependents) 
+{
+    taskori::Scheduler sched(2);
+    std::array<std::atomic<int>, 5> runs{};
+    auto count = [&](int node) { return [&runs, node]() { runs[node]++; }; };
+
+    auto graph = taskori::MakeStaticGraph<DIAMOND_PIPELINE>(count(0),
+        [&]() 
+        {
+        runs[1]++;
+        throw std::runtime_error("node failed");
+        },
+        count(2), count(3), count(4));
+
+    EXPECT_THROW(sched.Run(graph), std::runtime_error);
+    EXPECT_EQ(runs[0].load(), 1);
+    EXPECT_EQ(runs[1].load(), 1);
+    EXPECT_EQ(runs[2].load(), 1);
+    EXPECT_EQ(runs[3].load(), 0);
+    EXPECT_EQ(runs[4].load(), 0);
+}
+
 int main(int argc, char** argv) 
 {
     ::testing::InitGoogleTest(&argc, argv);
@@ -3,203 +3,3919 @@
 
 #include <thread>
 #include <mutex>
-#include <condition_variable>
 #include <functional>
-#include <queue>
 #include <vector>
 #include <atomic>
 #include <future>
 #include <memory>
 #include <random>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <concepts>
+#include <exception>
+#include <stdexcept>
+#include <memory_resource>
+#include <utility>
+#include <tuple>
+#include <type_traits>
+#include <cstddef>
+#include <new>
+#include <ranges>
+#include <optional>
+#include <iterator>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+// Bytes of callable state a job can hold without a heap allocation.
+#ifndef TASKORI_JOB_INLINE_SIZE
+#define TASKORI_JOB_INLINE_SIZE 64
+#endif
 
 namespace taskori {
 
-class Scheduler 
+inline constexpr std::size_t CacheLineSize = 64;
+
+// Move-only, type-erased void() callable. Callables up to Capacity bytes (and
+// nothrow movable) live in the inline buffer, larger ones fall back to the heap.
+template<std::size_t Capacity>
+class InlineJob
 {
 public:
-    using Job = std::function<void()>;
+    InlineJob() noexcept = default;
+    InlineJob(std::nullptr_t) noexcept {}
 
-    struct JobEntry 
+    template<typename F>
+        requires (!std::is_same_v<std::decay_t<F>, InlineJob> && std::is_invocable_v<std::decay_t<F>&>)
+    InlineJob(F&& f)
     {
-        Job job;
-        int priority = 0;
-        std::atomic<int> remainingDeps{ 0 };
-        std::vector<std::shared_ptr<JobEntry>> dependents;
-        std::promise<void> promise;
-        std::atomic<bool> finished{ false };
-        std::mutex depMutex; // thread safe dependents
-    };
+        Emplace<std::decay_t<F>>(std::forward<F>(f));
+    }
 
-    explicit Scheduler(unsigned int workerCount = std::thread::hardware_concurrency())
-        : m_Stop(false), m_ActiveJobCount(0), m_WorkerCount(workerCount)
+    InlineJob(InlineJob&& other) noexcept
     {
-        m_Queues.resize(workerCount);
-        for (unsigned int i = 0; i < workerCount; i++)
-            m_QueueMutexes.emplace_back(std::make_unique<std::mutex>());
-        Start(workerCount);
+        MoveFrom(other);
     }
 
-    ~Scheduler() 
+    InlineJob& operator=(InlineJob&& other) noexcept
     {
-        Shutdown();
+        if (this != &other)
+        {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
     }
 
-    std::shared_ptr<JobEntry> Submit(Job job, int priority = 0,
-        std::vector<std::shared_ptr<JobEntry>> deps = {}) noexcept
+    InlineJob& operator=(std::nullptr_t) noexcept
     {
-        auto entry = std::make_shared<JobEntry>();
-        entry->job = std::move(job);
-        entry->priority = priority;
-        entry->remainingDeps = static_cast<int>(deps.size());
+        Reset();
+        return *this;
+    }
+
+    InlineJob(const InlineJob&) = delete;
+    InlineJob& operator=(const InlineJob&) = delete;
+
+    ~InlineJob()
+    {
+        Reset();
+    }
+
+    // Constructs the callable directly in this job's storage
+    template<typename F, typename... Args>
+    void Emplace(Args&&... args)
+    {
+        Reset();
+        if constexpr (FitsInline<F>)
+            new (m_Storage) F(std::forward<Args>(args)...);
+        else
+            new (m_Storage) F*(new F(std::forward<Args>(args)...));
+        m_Ops = &OpsFor<F>;
+    }
 
-        for (auto& dep : deps) 
+    void operator()()
+    {
+        m_Ops->invoke(m_Storage);
+    }
+
+    // Value produced by the callable, if it keeps one (see Scheduler::Submit)
+    void* Result() noexcept
+    {
+        return m_Ops ? m_Ops->result(m_Storage) : nullptr;
+    }
+
+    void Reset() noexcept
+    {
+        if (m_Ops)
         {
-            std::lock_guard<std::mutex> lock(dep->depMutex);
-            dep->dependents.push_back(entry);
+            m_Ops->destroy(m_Storage);
+            m_Ops = nullptr;
         }
+    }
 
-        if (entry->remainingDeps == 0)
-            Enqueue(entry);
+    explicit operator bool() const noexcept { return m_Ops != nullptr; }
 
-        return entry;
+    template<typename F>
+    static constexpr bool FitsInline = sizeof(F) <= Capacity
+        && alignof(F) <= alignof(std::max_align_t)
+        && std::is_nothrow_move_constructible_v<F>;
+
+private:
+    struct Ops
+    {
+        void (*invoke)(void* storage);
+        void (*move)(void* dst, void* src) noexcept;
+        void (*destroy)(void* storage) noexcept;
+        void* (*result)(void* storage) noexcept;
+    };
+
+    template<typename F>
+    static F& Target(void* storage) noexcept
+    {
+        if constexpr (FitsInline<F>)
+            return *std::launder(static_cast<F*>(storage));
+        else
+            return **std::launder(static_cast<F**>(storage));
     }
 
-    std::future<void> GetFuture(std::shared_ptr<JobEntry> entry) 
+    template<typename F>
+    static constexpr Ops OpsFor = {
+        [](void* storage) { Target<F>(storage)(); },
+        [](void* dst, void* src) noexcept
+        {
+            if constexpr (FitsInline<F>)
+            {
+                new (dst) F(std::move(Target<F>(src)));
+                Target<F>(src).~F();
+            }
+            else
+            {
+                new (dst) F*(&Target<F>(src));
+            }
+        },
+        [](void* storage) noexcept
+        {
+            if constexpr (FitsInline<F>)
+                Target<F>(storage).~F();
+            else
+                delete &Target<F>(storage);
+        },
+        [](void* storage) noexcept -> void*
+        {
+            if constexpr (requires(F& f) { { f.Result() } -> std::same_as<void*>; })
+                return Target<F>(storage).Result();
+            else
+                return nullptr;
+        }
+    };
+
+    void MoveFrom(InlineJob& other) noexcept
     {
-        return entry->promise.get_future();
+        if (other.m_Ops)
+        {
+            other.m_Ops->move(m_Storage, other.m_Storage);
+            m_Ops = std::exchange(other.m_Ops, nullptr);
+        }
     }
 
-    void WaitAll() noexcept 
+    alignas(std::max_align_t) unsigned char m_Storage[Capacity];
+    const Ops* m_Ops = nullptr;
+};
+
+namespace detail {
+
+// Hint to the CPU that we are busy-waiting
+inline void CpuRelax() noexcept
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+}
+
+// Chase-Lev work-stealing deque (Le et al., "Correct and Efficient Work-Stealing
+// for Weak Memory Models"). The owning thread pushes and pops at the bottom,
+// any other thread may steal from the top. The ring buffer grows on demand;
+// retired buffers are kept until destruction since thieves may still read them.
+template<typename T>
+class WorkStealingDeque
+{
+public:
+    static constexpr std::int64_t InitialCapacity = 256;
+
+    explicit WorkStealingDeque(std::int64_t capacity = InitialCapacity)
+    {
+        m_Buffers.emplace_back(std::make_unique<Buffer>(capacity));
+        m_Buffer.store(m_Buffers.back().get(), std::memory_order_relaxed);
+    }
+
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    // Owner only.
+    void Push(T item) noexcept
+    {
+        std::int64_t bottom = m_Bottom.load(std::memory_order_relaxed);
+        std::int64_t top = m_Top.load(std::memory_order_acquire);
+        Buffer* buffer = m_Buffer.load(std::memory_order_relaxed);
+
+        if (bottom - top > buffer->capacity - 1)
+            buffer = Grow(buffer, top, bottom, buffer->capacity * 2);
+
+        buffer->Put(bottom, item);
+        m_Bottom.store(bottom + 1, std::memory_order_release);
+    }
+
+    // Owner only. Grows the buffer up front so capacity items fit without
+    // Push allocating.
+    void Reserve(std::int64_t capacity)
+    {
+        Buffer* buffer = m_Buffer.load(std::memory_order_relaxed);
+        if (buffer->capacity >= capacity)
+            return;
+
+        std::int64_t grown = buffer->capacity;
+        while (grown < capacity)
+            grown *= 2;
+        Grow(buffer, m_Top.load(std::memory_order_acquire), m_Bottom.load(std::memory_order_relaxed), grown);
+    }
+
+    // Owner only. Returns nullptr-equivalent T{} when empty.
+    T Pop() noexcept
     {
-        std::unique_lock<std::mutex> lock(m_GlobalMutex);
-        m_GlobalCondition.wait(lock, [this] 
+        std::int64_t bottom = m_Bottom.load(std::memory_order_relaxed) - 1;
+        Buffer* buffer = m_Buffer.load(std::memory_order_relaxed);
+        m_Bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t top = m_Top.load(std::memory_order_relaxed);
+
+        T item{};
+        if (top <= bottom)
+        {
+            item = buffer->Get(bottom);
+            if (top == bottom)
             {
-            return m_ActiveJobCount.load() == 0 && AllQueuesEmpty();
-            });
+                // Last element, race against thieves
+                if (!m_Top.compare_exchange_strong(top, top + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed))
+                    item = T{};
+                m_Bottom.store(bottom + 1, std::memory_order_relaxed);
+            }
+        }
+        else
+        {
+            m_Bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return item;
     }
 
-    void Shutdown() noexcept 
+    // Any thread. Returns T{} when empty or when losing a race.
+    T Steal() noexcept
     {
-        m_Stop = true;
-        m_GlobalCondition.notify_all();
+        std::int64_t top = m_Top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t bottom = m_Bottom.load(std::memory_order_acquire);
 
-        for (auto& worker : m_Workers)
-            if (worker.joinable())
-                worker.join();
+        if (top >= bottom)
+            return T{};
 
-        m_Workers.clear();
+        Buffer* buffer = m_Buffer.load(std::memory_order_acquire);
+        T item = buffer->Get(top);
+        if (!m_Top.compare_exchange_strong(top, top + 1,
+            std::memory_order_seq_cst, std::memory_order_relaxed))
+            return T{};
+        return item;
+    }
+
+    bool Empty() const noexcept
+    {
+        std::int64_t top = m_Top.load(std::memory_order_acquire);
+        std::int64_t bottom = m_Bottom.load(std::memory_order_acquire);
+        return top >= bottom;
     }
 
 private:
-    struct CompareJob 
+    struct Buffer
     {
-        bool operator()(const std::shared_ptr<JobEntry>& a,
-            const std::shared_ptr<JobEntry>& b) const noexcept
+        explicit Buffer(std::int64_t cap)
+            : capacity(cap), mask(cap - 1), items(new std::atomic<T>[static_cast<std::size_t>(cap)])
+        {
+        }
+
+        void Put(std::int64_t i, T item) noexcept
+        {
+            items[static_cast<std::size_t>(i & mask)].store(item, std::memory_order_relaxed);
+        }
+
+        T Get(std::int64_t i) const noexcept
         {
-            return a->priority < b->priority;
+            return items[static_cast<std::size_t>(i & mask)].load(std::memory_order_relaxed);
         }
+
+        std::int64_t capacity;
+        std::int64_t mask;
+        std::unique_ptr<std::atomic<T>[]> items;
     };
 
-    using QueueType = std::priority_queue<std::shared_ptr<JobEntry>,
-        std::vector<std::shared_ptr<JobEntry>>,
-        CompareJob>;
+    Buffer* Grow(Buffer* old, std::int64_t top, std::int64_t bottom, std::int64_t capacity)
+    {
+        auto grown = std::make_unique<Buffer>(capacity);
+        for (std::int64_t i = top; i < bottom; i++)
+            grown->Put(i, old->Get(i));
 
-    void Start(unsigned int threadCount) noexcept 
+        Buffer* raw = grown.get();
+        m_Buffers.emplace_back(std::move(grown));
+        m_Buffer.store(raw, std::memory_order_release);
+        return raw;
+    }
+
+    alignas(CacheLineSize) std::atomic<std::int64_t> m_Top{ 0 };
+    alignas(CacheLineSize) std::atomic<std::int64_t> m_Bottom{ 0 };
+    alignas(CacheLineSize) std::atomic<Buffer*> m_Buffer{ nullptr };
+    std::vector<std::unique_ptr<Buffer>> m_Buffers; // owner only
+};
+
+// Callable plus its arguments, stored together so Submit(f, args...) needs no
+// extra closure. Runs once, so everything is moved into the call.
+template<typename F, typename... Args>
+struct BoundJob
+{
+    F fn;
+    std::tuple<Args...> args;
+
+    decltype(auto) operator()()
+    {
+        return std::apply(std::move(fn), std::move(args));
+    }
+};
+
+template<typename F>
+using JobResult = std::remove_cvref_t<std::invoke_result_t<F&>>;
+
+// Wraps a value-returning callable. Once run, the callable is destroyed and
+// its result is constructed in the same storage, so a Task's value lives
+// inside the job's inline buffer.
+template<typename F, typename R>
+class ResultJob
+{
+public:
+    template<typename... Args>
+    explicit ResultJob(std::in_place_t, Args&&... args)
+        : m_Fn(std::forward<Args>(args)...)
     {
-        for (unsigned int i = 0; i < threadCount; i++)
-            m_Workers.emplace_back([this, i] { Worker(i); });
     }
 
-    void Enqueue(std::shared_ptr<JobEntry> entry) noexcept 
+    ResultJob(ResultJob&& other) noexcept(std::is_nothrow_move_constructible_v<F>
+        && std::is_nothrow_move_constructible_v<R>)
+        : m_State(other.m_State)
     {
-        static thread_local std::mt19937 rng(std::random_device{}());
-        std::uniform_int_distribution<size_t> dist(0, m_WorkerCount - 1);
-        size_t idx = dist(rng);
+        if (m_State == State::Pending)
+            new (&m_Fn) F(std::move(other.m_Fn));
+        else if (m_State == State::Ready)
+            new (&m_Value) R(std::move(other.m_Value));
+    }
+
+    ResultJob& operator=(ResultJob&&) = delete;
+
+    ~ResultJob()
+    {
+        Destroy();
+    }
+
+    void operator()()
+    {
+        R value = std::invoke(m_Fn);
+        Destroy();
+        new (&m_Value) R(std::move(value));
+        m_State = State::Ready;
+    }
+
+    void* Result() noexcept
+    {
+        return m_State == State::Ready ? &m_Value : nullptr;
+    }
 
+private:
+    enum class State : unsigned char { Pending, Ready, Empty };
+
+    void Destroy() noexcept
+    {
+        if (m_State == State::Pending)
+            m_Fn.~F();
+        else if (m_State == State::Ready)
+            m_Value.~R();
+        m_State = State::Empty;
+    }
+
+    union
+    {
+        F m_Fn;
+        R m_Value;
+    };
+    State m_State = State::Pending;
+};
+
+} // namespace detail
+
+// Thrown from Task::Get (and futures) of jobs dropped by a CancellationSource
+class JobCancelled : public std::runtime_error
+{
+public:
+    JobCancelled()
+        : std::runtime_error("taskori: job cancelled")
+    {
+    }
+};
+
+namespace detail {
+
+struct CancellationState
+{
+    std::atomic<bool> cancelled{ false };
+    // Created up front so cancelling and dropping jobs never allocates
+    std::exception_ptr exception = std::make_exception_ptr(JobCancelled());
+};
+
+// Outstanding-job counter of a TaskGroup, decremented by the worker that
+// completes each of its jobs. Waiters sleep on the counter itself. The last
+// job moves it to Closing rather than zero, so the state can't be destroyed
+// while its finisher is still waking them; zero is its final store.
+struct GroupState
+{
+    static constexpr int Closing = -1;
+
+    alignas(CacheLineSize) std::atomic<int> pending{ 0 };
+    std::atomic<int> helpers{ 0 }; // workers parked until the group is done
+    std::atomic<bool> failed{ false };
+    std::exception_ptr exception;
+
+    bool IsIdle() const noexcept
+    {
+        return pending.load(std::memory_order_acquire) == 0;
+    }
+
+    // True once the last job has started finishing
+    bool IsSettling() const noexcept
+    {
+        return pending.load(std::memory_order_acquire) <= 0;
+    }
+
+    void Add() noexcept
+    {
+        int count = pending.load(std::memory_order_relaxed);
+        for (;;)
         {
-            std::lock_guard<std::mutex> lock(*m_QueueMutexes[idx]);
-            m_Queues[idx].push(entry);
+            if (count == Closing)
+            {
+                std::this_thread::yield();
+                count = pending.load(std::memory_order_relaxed);
+            }
+            else if (pending.compare_exchange_weak(count, count + 1, std::memory_order_relaxed))
+            {
+                return;
+            }
         }
-        m_GlobalCondition.notify_one();
     }
 
-    bool AllQueuesEmpty() 
+    void Fail(const std::exception_ptr& error) noexcept
     {
-        for (auto& q : m_Queues)
-            if (!q.empty()) return false;
-        return true;
+        bool expected = false;
+        if (failed.compare_exchange_strong(expected, true, std::memory_order_acq_rel))
+            exception = error;
     }
+};
 
-    void Worker(size_t id) 
+} // namespace detail
+
+class Scheduler;
+
+namespace detail {
+
+// Anything a worker can pop and run: pooled job entries and graph nodes. A
+// plain function pointer keeps the queues free of virtual calls.
+struct WorkItem
+{
+    void (*run)(Scheduler& scheduler, WorkItem* item) noexcept = nullptr;
+    int priority = 0;
+};
+
+} // namespace detail
+
+// Cheap, copyable view of a CancellationSource. A default constructed token
+// is never cancelled.
+class CancellationToken
+{
+public:
+    CancellationToken() noexcept = default;
+
+    // Safe to poll from long running jobs, a single relaxed load
+    bool IsCancellationRequested() const noexcept
     {
-        while (!m_Stop) 
+        return m_State && m_State->cancelled.load(std::memory_order_relaxed);
+    }
+
+    explicit operator bool() const noexcept { return m_State != nullptr; }
+
+private:
+    friend class CancellationSource;
+    friend class Scheduler;
+
+    explicit CancellationToken(std::shared_ptr<detail::CancellationState> state) noexcept
+        : m_State(std::move(state))
+    {
+    }
+
+    std::shared_ptr<detail::CancellationState> m_State;
+};
+
+// Cancel() is O(1): it only flips a flag. Workers drop jobs carrying a
+// cancelled token when they dequeue them; their dependents fail with
+// JobCancelled and are skipped as well.
+class CancellationSource
+{
+public:
+    CancellationSource()
+        : m_State(std::make_shared<detail::CancellationState>())
+    {
+    }
+
+    CancellationToken Token() const noexcept
+    {
+        return CancellationToken(m_State);
+    }
+
+    void Cancel() noexcept
+    {
+        m_State->cancelled.store(true, std::memory_order_release);
+    }
+
+    bool IsCancellationRequested() const noexcept
+    {
+        return m_State->cancelled.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::shared_ptr<detail::CancellationState> m_State;
+};
+
+template<typename T>
+class Task;
+
+class TaskGroup;
+class TaskGraph;
+
+template<typename Body>
+class CompactTaskGraph;
+
+template<auto Edges, typename... Jobs>
+class StaticGraph;
+
+class Scheduler 
+{
+public:
+    using Job = InlineJob<TASKORI_JOB_INLINE_SIZE>;
+
+    // Priorities are bucketed into PriorityLevels bands (clamped to
+    // [0, PriorityLevels - 1]); within a queue higher bands run first.
+    static constexpr int PriorityLevels = 4;
+
+    struct JobEntry;
+
+    // std::promise attached to an entry on first GetFuture, fulfilled on completion
+    struct FutureLink
+    {
+        virtual ~FutureLink() = default;
+        virtual void Fulfil(JobEntry& entry) = 0;
+    };
+
+    // Owns the JobEntry slabs. Allocated on its own so it can outlive the
+    // Scheduler: the destructor orphans it, after which it counts the entries
+    // handles still reference and the last one released frees it. Both sides
+    // of that hand-over take the mutex.
+    struct EntryPool
+    {
+        std::pmr::memory_resource* resource;
+        std::mutex mutex;
+        JobEntry* freeList = nullptr;
+        std::vector<JobEntry*> slabs;
+        std::size_t live = 0; // once orphaned: entries not returned yet
+        bool orphaned = false;
+
+        explicit EntryPool(std::pmr::memory_resource* resource) noexcept
+            : resource(resource)
         {
-            std::shared_ptr<JobEntry> jobEntry;
+        }
 
-            // Try local queue
+        // Takes back an entry released by its last handle
+        void Push(JobEntry& entry) noexcept
+        {
             {
-                std::lock_guard<std::mutex> lock(*m_QueueMutexes[id]);
-                if (!m_Queues[id].empty()) 
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!orphaned)
                 {
-                    jobEntry = m_Queues[id].top();
-                    m_Queues[id].pop();
-                    m_ActiveJobCount.fetch_add(1, std::memory_order_relaxed);
+                    entry.next = freeList;
+                    freeList = &entry;
+                    return;
                 }
+                if (--live != 0)
+                    return;
             }
+            Free();
+        }
 
-            // Task stealing
-            if (!jobEntry) 
+        // Called by the scheduler once every cached entry is back
+        void Orphan() noexcept
+        {
             {
-                for (size_t i = 0; i < m_WorkerCount; i++) 
-                {
-                    if (i == id) continue;
-                    std::lock_guard<std::mutex> lock(*m_QueueMutexes[i]);
-                    if (!m_Queues[i].empty()) 
-                    {
-                        jobEntry = m_Queues[i].top();
-                        m_Queues[i].pop();
-                        m_ActiveJobCount.fetch_add(1, std::memory_order_relaxed);
-                        break;
-                    }
-                }
+                std::lock_guard<std::mutex> lock(mutex);
+                live = slabs.size() * PoolSlabSize;
+                for (JobEntry* entry = freeList; entry; entry = entry->next)
+                    live--;
+                orphaned = true;
+                if (live != 0)
+                    return;
             }
+            Free();
+        }
 
-            if (!jobEntry) 
+        void Free() noexcept
+        {
+            for (JobEntry* slab : slabs)
             {
-                std::unique_lock<std::mutex> lock(m_GlobalMutex);
-                m_GlobalCondition.wait_for(lock, std::chrono::milliseconds(1));
-                continue;
+                for (std::size_t i = 0; i < PoolSlabSize; i++)
+                    slab[i].~JobEntry();
+                resource->deallocate(slab, sizeof(JobEntry) * PoolSlabSize, alignof(JobEntry));
             }
+            delete this;
+        }
+    };
 
-            // Execute job
-            jobEntry->job();
+    // Intrusive reference to a pooled JobEntry. Handles may outlive the
+    // Scheduler: a finished task can still be read, and the slabs are freed
+    // once the last handle is released (see EntryPool).
+    class JobHandle
+    {
+    public:
+        JobHandle() noexcept = default;
 
-            if (!jobEntry->finished.exchange(true)) 
-            {
-                jobEntry->promise.set_value();
-                // Trigger dependents
-                std::lock_guard<std::mutex> depLock(jobEntry->depMutex);
-                for (auto& dep : jobEntry->dependents) 
-                {
-                    if (--dep->remainingDeps == 0)
-                        Enqueue(dep);
-                }
-            }
+        JobHandle(const JobHandle& other) noexcept
+            : m_Entry(other.m_Entry)
+        {
+            if (m_Entry)
+                m_Entry->AddRef();
+        }
 
-            m_ActiveJobCount.fetch_sub(1, std::memory_order_relaxed);
-            m_GlobalCondition.notify_all();
+        JobHandle(JobHandle&& other) noexcept
+            : m_Entry(std::exchange(other.m_Entry, nullptr))
+        {
         }
-    }
 
-    unsigned int m_WorkerCount;
-    std::vector<std::thread> m_Workers;
-    std::vector<QueueType> m_Queues;
-    std::vector<std::unique_ptr<std::mutex>> m_QueueMutexes;
-    std::mutex m_GlobalMutex;
-    std::condition_variable m_GlobalCondition;
-    std::atomic<int> m_ActiveJobCount{ 0 };
-    std::atomic<bool> m_Stop;
-};
+        JobHandle& operator=(JobHandle other) noexcept
+        {
+            std::swap(m_Entry, other.m_Entry);
+            return *this;
+        }
+
+        ~JobHandle()
+        {
+            Reset();
+        }
+
+        void Reset() noexcept
+        {
+            if (JobEntry* entry = std::exchange(m_Entry, nullptr))
+                entry->Release();
+        }
+
+        JobEntry* Entry() const noexcept { return m_Entry; }
+        JobEntry* operator->() const noexcept { return m_Entry; }
+        JobEntry& operator*() const noexcept { return *m_Entry; }
+        explicit operator bool() const noexcept { return m_Entry != nullptr; }
+
+    private:
+        friend class Scheduler;
+
+        // Adopts a reference that the caller already holds
+        explicit JobHandle(JobEntry* entry) noexcept
+            : m_Entry(entry)
+        {
+        }
+
+        JobEntry* m_Entry = nullptr;
+    };
+
+    struct alignas(CacheLineSize) JobEntry : detail::WorkItem
+    {
+        Job job;
+        int affinity = -1; // worker whose queue it goes to, -1 for the default placement
+        std::atomic<int> remainingDeps{ 0 };
+        std::vector<JobHandle> dependents;
+        std::unique_ptr<FutureLink> future; // created on first GetFuture
+        std::atomic<bool> finished{ false };
+        std::mutex depMutex; // thread safe dependents, future and finished
+        int helpers = 0; // workers parked in Wait, guarded by depMutex
+
+        // Set by the job itself or inherited from a failed dependency. A failed
+        // entry is completed without running, failing its own dependents in turn.
+        std::exception_ptr exception;
+        std::atomic<bool> failed{ false };
+        CancellationToken token;
+        detail::GroupState* group = nullptr;
+
+        std::atomic<int> refCount{ 0 };
+        Scheduler* scheduler = nullptr; // only used while the job is unfinished
+        EntryPool* pool = nullptr;
+        JobEntry* next = nullptr; // free list link
+
+        JobEntry() noexcept
+        {
+            run = &Scheduler::RunJob;
+        }
+
+        void AddRef() noexcept
+        {
+            refCount.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void Release() noexcept
+        {
+            if (refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                Scheduler::Recycle(this);
+        }
+
+        // First failure wins; called before the entry can be run
+        void Fail(std::exception_ptr error) noexcept
+        {
+            bool expected = false;
+            if (failed.compare_exchange_strong(expected, true, std::memory_order_acq_rel))
+                exception = std::move(error);
+        }
+    };
+
+    // Idle workers poll this many times, then yield this many times, then park
+    static constexpr int SpinCount = 64;
+    static constexpr int YieldCount = 16;
+
+    // Entries are carved out of slabs of this many JobEntry objects
+    static constexpr std::size_t PoolSlabSize = 256;
+    // Entries moved between a worker's cache and the shared free list at once
+    static constexpr std::size_t PoolBatchSize = 64;
+    // Inbox slots each worker starts with, like the deques' initial capacity
+    static constexpr std::size_t InboxCapacity = 256;
+    // Deque slots per priority band a graph run may reserve on each worker
+    static constexpr std::size_t MaxQueueReserve = 4096;
+
+    explicit Scheduler(unsigned int workerCount = std::thread::hardware_concurrency(),
+        std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_Stop(false), m_ActiveJobCount(0), m_WorkerCount(workerCount), m_Pool(new EntryPool(resource))
+    {
+        for (unsigned int i = 0; i < workerCount; i++)
+            m_WorkerStates.emplace_back(std::make_unique<WorkerState>());
+        Start(workerCount);
+    }
+
+    ~Scheduler() 
+    {
+        Shutdown();
+        ReleasePool();
+    }
+
+    // Returns a Task<R> for the callable's return type R; the result is kept
+    // inside the job and can be read in place with Task::Get.
+    template<typename F>
+        requires std::is_invocable_v<std::decay_t<F>&>
+    Task<detail::JobResult<std::decay_t<F>>> Submit(F&& job, int priority = 0,
+        std::initializer_list<JobHandle> deps = {}, CancellationToken token = {}) noexcept
+    {
+        JobEntry* entry = AllocateEntry();
+        StoreJob(entry->job, std::forward<F>(job));
+        entry->token = std::move(token);
+        return Task<detail::JobResult<std::decay_t<F>>>(Schedule(entry, priority, deps.begin(), deps.size()));
+    }
+
+    template<typename F>
+        requires std::is_invocable_v<std::decay_t<F>&>
+    Task<detail::JobResult<std::decay_t<F>>> Submit(F&& job, int priority,
+        const std::vector<JobHandle>& deps, CancellationToken token = {}) noexcept
+    {
+        JobEntry* entry = AllocateEntry();
+        StoreJob(entry->job, std::forward<F>(job));
+        entry->token = std::move(token);
+        return Task<detail::JobResult<std::decay_t<F>>>(Schedule(entry, priority, deps.data(), deps.size()));
+    }
+
+    // Submit(f, args...): the arguments are stored next to f in the job itself
+    template<typename F, typename... Args>
+        requires (sizeof...(Args) > 0 && std::is_invocable_v<std::decay_t<F>, std::decay_t<Args>...>)
+    auto Submit(F&& f, Args&&... args) noexcept
+    {
+        using Bound = detail::BoundJob<std::decay_t<F>, std::decay_t<Args>...>;
+
+        JobEntry* entry = AllocateEntry();
+        EmplaceJob<Bound>(entry->job, std::forward<F>(f), std::forward_as_tuple(std::forward<Args>(args)...));
+        return Task<detail::JobResult<Bound>>(Schedule(entry, 0, nullptr, 0));
+    }
+
+    // Submits independent jobs in one go: entries are allocated together, each
+    // worker inbox is locked at most once and at most one worker per chunk is woken.
+    // Elements are moved out of rvalue ranges and copied from lvalue ones, so
+    // a range of (move-only) Job objects has to be passed as an rvalue.
+    template<std::ranges::forward_range Range>
+    auto SubmitBatch(Range&& jobs, int priority = 0, const CancellationToken& token = {})
+    {
+        using Element = std::conditional_t<std::is_lvalue_reference_v<Range>,
+            std::ranges::range_reference_t<Range>, std::ranges::range_rvalue_reference_t<Range>>;
+        using Result = detail::JobResult<std::ranges::range_value_t<Range>>;
+
+        std::vector<Task<Result>> handles;
+        const std::size_t count = static_cast<std::size_t>(std::ranges::distance(jobs));
+        if (count == 0)
+            return handles;
+
+        handles.reserve(count);
+        AllocateEntries(count, handles);
+
+        std::size_t i = 0;
+        for (auto&& job : jobs)
+        {
+            JobEntry* entry = handles[i++].Entry();
+            StoreJob(entry->job, static_cast<Element>(job));
+            entry->priority = priority;
+            entry->token = token;
+            entry->AddRef(); // held by the queue until the job completes
+        }
+
+        EnqueueBatch(handles.data(), count);
+        return handles;
+    }
+
+    // Like std::promise::get_future, may only be called once per job. A
+    // non-void T receives a copy of the result; Task::Get reads it in place.
+    template<typename T>
+    static std::future<T> GetFuture(const Task<T>& task)
+    {
+        return AttachFuture<T>(task);
+    }
+
+    // For handles whose result type isn't known: only signals completion
+    static std::future<void> GetFuture(const JobHandle& handle)
+    {
+        return AttachFuture<void>(handle);
+    }
+
+    // Waits for one job. On one of our workers the calling thread keeps
+    // executing queued jobs (its own first, then stolen ones) until the awaited
+    // job is done, so nested waits can't starve or deadlock the pool. Any other
+    // thread parks until the job completes.
+    void Wait(const JobHandle& handle) noexcept
+    {
+        JobEntry* entry = handle.Entry();
+        if (!LocalState())
+        {
+            entry->finished.wait(false, std::memory_order_acquire);
+            return;
+        }
+
+        auto done = [entry] { return entry->finished.load(std::memory_order_acquire); };
+        HelpUntil(done, [this, entry, &done](WorkerState& local)
+            {
+            // Registered under the lock Execute sets finished with, so it
+            // either sees this helper or we see the job finished
+            {
+                std::lock_guard<std::mutex> lock(entry->depMutex);
+                if (entry->finished.load(std::memory_order_relaxed))
+                    return;
+                entry->helpers++;
+                local.waitKey.store(entry, std::memory_order_relaxed);
+            }
+            Park(local, done);
+            std::lock_guard<std::mutex> lock(entry->depMutex);
+            entry->helpers--;
+            local.waitKey.store(nullptr, std::memory_order_relaxed);
+            });
+    }
+
+    // Runs every node of a graph once, in dependency order, and waits like
+    // Wait does. Freezes the graph first if needed. Rethrows the first
+    // exception thrown by a node.
+    void Run(TaskGraph& graph);
+
+    template<typename Body>
+    void Run(CompactTaskGraph<Body>& graph)
+    {
+        RunGraph(graph);
+    }
+
+    template<auto Edges, typename... Jobs>
+    void Run(StaticGraph<Edges, Jobs...>& graph)
+    {
+        RunGraph(graph);
+    }
+
+    // Index of the calling worker thread, or -1 if it is not one of ours
+    int CurrentWorkerIndex() const noexcept
+    {
+        return s_CurrentWorker.scheduler == this ? static_cast<int>(s_CurrentWorker.index) : -1;
+    }
+
+    unsigned int WorkerCount() const noexcept
+    {
+        return m_WorkerCount;
+    }
+
+    // Whether the calling worker's deques are empty, i.e. everything it spawned
+    // has been taken by thieves. Always false on non-worker threads. Parallel
+    // algorithms use it to split work only when there is demand for it.
+    bool IsLocalQueueEmpty() noexcept
+    {
+        WorkerState* local = LocalState();
+        if (!local)
+            return false;
+        for (auto& queue : local->queues)
+            if (!queue.Empty())
+                return false;
+        return true;
+    }
+
+    void WaitAll() noexcept 
+    {
+        int active = m_ActiveJobCount.load(std::memory_order_acquire);
+        while (active != 0)
+        {
+            m_ActiveJobCount.wait(active, std::memory_order_acquire);
+            active = m_ActiveJobCount.load(std::memory_order_acquire);
+        }
+    }
+
+    void Shutdown() noexcept 
+    {
+        m_Stop = true;
+        for (auto& state : m_WorkerStates)
+            Unpark(*state);
+
+        for (auto& worker : m_Workers)
+            if (worker.joinable())
+                worker.join();
+
+        m_Workers.clear();
+
+        // Release entries that never got to run; graph nodes belong to their graph
+        for (auto& state : m_WorkerStates)
+        {
+            while (detail::WorkItem* item = PopLocal(*state))
+                if (item->run == &RunJob)
+                    static_cast<JobEntry*>(item)->Release();
+        }
+    }
+
+private:
+    friend class TaskGroup;
+    friend class TaskGraph;
+    template<typename Body>
+    friend class CompactTaskGraph;
+    template<auto Edges, typename... Jobs>
+    friend class StaticGraph;
+
+    // Per-worker state, padded so neighbouring workers don't false-share.
+    struct alignas(CacheLineSize) WorkerState
+    {
+        WorkerState()
+        {
+            inbox.reserve(InboxCapacity);
+        }
+
+        std::array<detail::WorkStealingDeque<detail::WorkItem*>, PriorityLevels> queues;
+
+        // Jobs handed over by other threads; only the owner may push to its deques
+        std::mutex inboxMutex;
+        std::vector<detail::WorkItem*> inbox;
+        std::atomic<bool> hasInbox{ false };
+
+        // Recycled entries, owner only
+        JobEntry* freeList = nullptr;
+        std::size_t freeCount = 0;
+
+        // Deque capacity per band, grown by the owner (see ReserveQueues)
+        std::atomic<std::size_t> queueReserve{ detail::WorkStealingDeque<detail::WorkItem*>::InitialCapacity };
+
+        // Event count the owner parks on, see Park and Wake
+        alignas(CacheLineSize) std::atomic<std::uint32_t> epoch{ 0 };
+        std::atomic<bool> parked{ false };
+        std::atomic<const void*> waitKey{ nullptr }; // job or group a parked helper waits on
+    };
+
+    struct WorkerContext
+    {
+        Scheduler* scheduler;
+        unsigned int index;
+    };
+
+    static inline thread_local WorkerContext s_CurrentWorker;
+
+    static int Band(int priority) noexcept
+    {
+        return std::clamp(priority, 0, PriorityLevels - 1);
+    }
+
+    // State of the calling thread if it is one of our workers
+    WorkerState* LocalState() noexcept
+    {
+        if (s_CurrentWorker.scheduler != this)
+            return nullptr;
+        return m_WorkerStates[s_CurrentWorker.index].get();
+    }
+
+    void Start(unsigned int threadCount) noexcept 
+    {
+        for (unsigned int i = 0; i < threadCount; i++)
+            m_Workers.emplace_back([this, i] { Worker(i); });
+    }
+
+    template<typename F>
+    Task<detail::JobResult<std::decay_t<F>>> SubmitToGroup(detail::GroupState& group, F&& job,
+        int priority, CancellationToken&& token, int affinity = -1) noexcept
+    {
+        JobEntry* entry = AllocateEntry();
+        StoreJob(entry->job, std::forward<F>(job));
+        entry->token = std::move(token);
+        entry->group = &group;
+        entry->affinity = affinity;
+        group.Add();
+        return Task<detail::JobResult<std::decay_t<F>>>(Schedule(entry, priority, nullptr, 0));
+    }
+
+    // T must be the job's result type, which the public overloads guarantee
+    template<typename T>
+    static std::future<T> AttachFuture(const JobHandle& entry)
+    {
+        std::lock_guard<std::mutex> lock(entry->depMutex);
+        if (entry->future)
+        {
+            auto* link = dynamic_cast<PromiseLink<T>*>(entry->future.get());
+            if (!link)
+                throw std::future_error(std::future_errc::future_already_retrieved);
+            return link->promise.get_future();
+        }
+
+        auto link = std::make_unique<PromiseLink<T>>();
+        std::future<T> future = link->promise.get_future();
+        if (entry->finished.load(std::memory_order_relaxed))
+            link->Fulfil(*entry);
+        entry->future = std::move(link);
+        return future;
+    }
+
+    template<typename T>
+    struct PromiseLink : FutureLink
+    {
+        std::promise<T> promise;
+
+        void Fulfil(JobEntry& entry) override
+        {
+            if (entry.exception)
+                promise.set_exception(entry.exception);
+            else if constexpr (std::is_void_v<T>)
+                promise.set_value();
+            else
+                promise.set_value(*static_cast<T*>(entry.job.Result()));
+        }
+    };
+
+    // Value-returning callables are wrapped so their result stays in the job
+    template<typename F, typename... Args>
+    static void EmplaceJob(Job& slot, Args&&... args)
+    {
+        using Result = detail::JobResult<F>;
+        if constexpr (std::is_void_v<Result>)
+            slot.template Emplace<F>(std::forward<Args>(args)...);
+        else
+            slot.template Emplace<detail::ResultJob<F, Result>>(std::in_place, std::forward<Args>(args)...);
+    }
+
+    template<typename F>
+    static void StoreJob(Job& slot, F&& job)
+    {
+        if constexpr (std::is_same_v<std::decay_t<F>, Job>)
+        {
+            // Jobs are move-only; taking an lvalue would empty the caller's job
+            static_assert(!std::is_lvalue_reference_v<F>, "Scheduler: pass Job objects as rvalues (std::move)");
+            slot = std::move(job);
+        }
+        else
+            EmplaceJob<std::decay_t<F>>(slot, std::forward<F>(job));
+    }
+
+    JobHandle Schedule(JobEntry* entry, int priority, const JobHandle* deps, std::size_t depCount) noexcept
+    {
+        entry->priority = priority;
+
+        // One extra count so dependencies finishing mid-submit can't enqueue early
+        int satisfied = 1;
+        entry->remainingDeps.store(static_cast<int>(depCount) + 1, std::memory_order_relaxed);
+
+        for (std::size_t i = 0; i < depCount; i++) 
+        {
+            JobEntry* dep = deps[i].Entry();
+            std::lock_guard<std::mutex> lock(dep->depMutex);
+            if (dep->finished.load(std::memory_order_relaxed))
+            {
+                if (dep->exception)
+                    entry->Fail(dep->exception);
+                satisfied++;
+                continue;
+            }
+            entry->AddRef();
+            dep->dependents.push_back(JobHandle(entry));
+        }
+
+        if (entry->remainingDeps.fetch_sub(satisfied, std::memory_order_acq_rel) == satisfied)
+            Enqueue(entry);
+
+        return JobHandle(entry);
+    }
+
+    size_t RandomWorker() const noexcept
+    {
+        static thread_local std::mt19937 rng(std::random_device{}());
+        std::uniform_int_distribution<size_t> dist(0, m_WorkerCount - 1);
+        return dist(rng);
+    }
+
+    // Jobs spawned on a worker (including released dependents) stay on that
+    // worker's deque where their data is cache-warm; external submitters
+    // spread jobs randomly. Jobs with an affinity go to that worker's inbox,
+    // where idle workers can still steal them.
+    void Enqueue(JobEntry* entry) noexcept 
+    {
+        entry->AddRef(); // held by the queue until the job completes
+        Push(entry, entry->affinity);
+    }
+
+    // Counts the item as active and queues it; see Enqueue for the placement
+    void Push(detail::WorkItem* item, int affinity) noexcept
+    {
+        m_ActiveJobCount.fetch_add(1, std::memory_order_relaxed);
+
+        WorkerState* local = LocalState();
+        const bool routed = affinity >= 0;
+        if (local && (!routed || static_cast<unsigned int>(affinity) % m_WorkerCount == s_CurrentWorker.index))
+        {
+            // A job routed here needs no one else, its owner is running
+            local->queues[Band(item->priority)].Push(item);
+            if (!routed)
+                Wake(1);
+            return;
+        }
+
+        WorkerState& state = *m_WorkerStates[routed ? static_cast<unsigned int>(affinity) % m_WorkerCount : RandomWorker()];
+        {
+            std::lock_guard<std::mutex> lock(state.inboxMutex);
+            state.inbox.push_back(item);
+            state.hasInbox.store(true, std::memory_order_release);
+        }
+
+        // Routed jobs wake only their owner, waking others would invite them
+        // to steal it
+        if (routed)
+            WakeWorker(state);
+        else
+            Wake(1);
+    }
+
+    static detail::WorkItem* ItemOf(const JobHandle& handle) noexcept
+    {
+        return handle.Entry();
+    }
+
+    static detail::WorkItem* ItemOf(detail::WorkItem* item) noexcept
+    {
+        return item;
+    }
+
+    // Job entries must already hold the queue's reference. Splits the items
+    // into contiguous chunks, one per worker inbox, starting at the calling
+    // worker (whose chunk goes straight to its deque) or at a random worker for
+    // external callers.
+    template<typename Handle>
+    void EnqueueBatch(const Handle* entries, std::size_t count) noexcept
+    {
+        m_ActiveJobCount.fetch_add(static_cast<int>(count), std::memory_order_relaxed);
+
+        const std::size_t chunks = std::min<std::size_t>(count, m_WorkerCount);
+        const std::size_t chunkSize = (count + chunks - 1) / chunks;
+        WorkerState* local = LocalState();
+        size_t idx = local ? s_CurrentWorker.index : RandomWorker();
+
+        for (std::size_t begin = 0; begin < count; begin += chunkSize)
+        {
+            const std::size_t end = std::min(begin + chunkSize, count);
+            WorkerState& state = *m_WorkerStates[idx];
+            if (&state == local)
+            {
+                // Oldest pushed last so the owner pops it first
+                for (std::size_t i = end; i-- > begin;)
+                    state.queues[Band(ItemOf(entries[i])->priority)].Push(ItemOf(entries[i]));
+            }
+            else
+            {
+                std::lock_guard<std::mutex> lock(state.inboxMutex);
+                for (std::size_t i = begin; i < end; i++)
+                    state.inbox.push_back(ItemOf(entries[i]));
+                state.hasInbox.store(true, std::memory_order_release);
+            }
+            idx = (idx + 1) % m_WorkerCount;
+        }
+
+        Wake(local ? chunks - 1 : chunks);
+    }
+
+    // Per-worker event counts: wakes up to count parked workers, none if
+    // nobody is parked. A waker claims a sleeper by clearing its parked flag,
+    // so concurrent wakes pick different workers. Pairs with Park.
+    void Wake(std::size_t count) noexcept
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_Sleepers.load(std::memory_order_relaxed) == 0)
+            return;
+
+        for (std::size_t i = 0; i < m_WorkerCount && count > 0; i++)
+        {
+            if (Claim(*m_WorkerStates[i]))
+            {
+                Unpark(*m_WorkerStates[i]);
+                count--;
+            }
+        }
+    }
+
+    // Wakes the given worker if it is parked, and nobody else
+    void WakeWorker(WorkerState& state) noexcept
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_Sleepers.load(std::memory_order_relaxed) != 0 && Claim(state))
+            Unpark(state);
+    }
+
+    static bool Claim(WorkerState& state) noexcept
+    {
+        return state.parked.load(std::memory_order_relaxed) && state.parked.exchange(false, std::memory_order_acq_rel);
+    }
+
+    static void Unpark(WorkerState& state) noexcept
+    {
+        state.epoch.fetch_add(1, std::memory_order_seq_cst);
+        state.epoch.notify_one();
+    }
+
+    // Sleeps until woken, unless ready() holds or there is work to take
+    template<typename Predicate>
+    void Park(WorkerState& local, Predicate&& ready) noexcept
+    {
+        local.parked.store(true, std::memory_order_seq_cst);
+        m_Sleepers.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::uint32_t epoch = local.epoch.load(std::memory_order_seq_cst);
+
+        // Re-check after announcing ourselves so a concurrent Enqueue either
+        // sees the sleeper or we see its job
+        if (!ready() && !HasWork())
+            local.epoch.wait(epoch, std::memory_order_seq_cst);
+
+        local.parked.store(false, std::memory_order_relaxed);
+        m_Sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Wakes the helpers parked on key (see HelpUntil)
+    void WakeHelpers(const void* key) noexcept
+    {
+        for (auto& state : m_WorkerStates)
+            if (state->waitKey.load(std::memory_order_relaxed) == key)
+                Unpark(*state);
+    }
+
+    bool HasWork() const noexcept
+    {
+        for (auto& state : m_WorkerStates)
+        {
+            if (state->hasInbox.load(std::memory_order_acquire))
+                return true;
+            for (auto& queue : state->queues)
+                if (!queue.Empty())
+                    return true;
+        }
+        return false;
+    }
+
+    // Owner side of ReserveQueues
+    void ReserveLocalQueues(WorkerState& local) noexcept
+    {
+        const std::size_t reserve = m_QueueReserve.load(std::memory_order_acquire);
+        if (local.queueReserve.load(std::memory_order_relaxed) >= reserve)
+            return;
+        for (auto& queue : local.queues)
+            queue.Reserve(static_cast<std::int64_t>(reserve));
+        local.queueReserve.store(reserve, std::memory_order_release);
+    }
+
+    // Moves the inbox into the owner's deques. Returns false if it was empty.
+    bool DrainInbox(WorkerState& local) noexcept
+    {
+        if (!local.hasInbox.load(std::memory_order_acquire))
+            return false;
+
+        // Pushed straight from the inbox so its capacity is kept and a steady
+        // stream of handovers stops allocating. Oldest pushed last so the
+        // owner pops it first.
+        std::lock_guard<std::mutex> lock(local.inboxMutex);
+        for (auto it = local.inbox.rbegin(); it != local.inbox.rend(); ++it)
+            local.queues[Band((*it)->priority)].Push(*it);
+
+        bool any = !local.inbox.empty();
+        local.inbox.clear();
+        local.hasInbox.store(false, std::memory_order_relaxed);
+        return any;
+    }
+
+    detail::WorkItem* PopLocal(WorkerState& local) noexcept
+    {
+        do
+        {
+            for (int band = PriorityLevels - 1; band >= 0; band--)
+                if (detail::WorkItem* item = local.queues[band].Pop())
+                    return item;
+        } while (DrainInbox(local));
+
+        return nullptr;
+    }
+
+    detail::WorkItem* StealFrom(size_t id) noexcept
+    {
+        for (size_t n = 1; n < m_WorkerCount; n++) 
+        {
+            WorkerState& victim = *m_WorkerStates[(id + n) % m_WorkerCount];
+            for (int band = PriorityLevels - 1; band >= 0; band--)
+                if (detail::WorkItem* item = victim.queues[band].Steal())
+                    return item;
+
+            if (victim.hasInbox.load(std::memory_order_acquire))
+            {
+                std::lock_guard<std::mutex> lock(victim.inboxMutex);
+                if (!victim.inbox.empty())
+                {
+                    detail::WorkItem* item = victim.inbox.back();
+                    victim.inbox.pop_back();
+                    if (victim.inbox.empty())
+                        victim.hasInbox.store(false, std::memory_order_relaxed);
+                    return item;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    detail::WorkItem* FindWork(size_t id) noexcept
+    {
+        ReserveLocalQueues(*m_WorkerStates[id]);
+
+        // Try local queue
+        if (detail::WorkItem* item = PopLocal(*m_WorkerStates[id]))
+            return item;
+
+        // Task stealing
+        return StealFrom(id);
+    }
+
+    // Spin, then yield, then park until woken. Returns nullptr after parking.
+    detail::WorkItem* WaitForWork(size_t id) noexcept
+    {
+        for (int i = 0; i < SpinCount; i++)
+        {
+            detail::CpuRelax();
+            if (detail::WorkItem* item = FindWork(id))
+                return item;
+        }
+
+        for (int i = 0; i < YieldCount; i++)
+        {
+            std::this_thread::yield();
+            if (detail::WorkItem* item = FindWork(id))
+                return item;
+        }
+
+        Park(*m_WorkerStates[id], [this] { return m_Stop.load(); });
+        return nullptr;
+    }
+
+    // Runs queued jobs on the calling worker until done() holds. With nothing
+    // to run it spins, yields and then calls sleep(), which parks the worker
+    // where whatever completes the awaited job or group will wake it.
+    template<typename Predicate, typename Sleep>
+    void HelpUntil(Predicate&& done, Sleep&& sleep) noexcept
+    {
+        const size_t id = s_CurrentWorker.index;
+        int idle = 0;
+        while (!done())
+        {
+            if (detail::WorkItem* item = FindWork(id))
+            {
+                item->run(*this, item);
+                idle = 0;
+            }
+            else if (++idle < SpinCount)
+            {
+                detail::CpuRelax();
+            }
+            else if (idle < SpinCount + YieldCount)
+            {
+                std::this_thread::yield();
+            }
+            else
+            {
+                sleep(*m_WorkerStates[id]);
+                idle = 0;
+            }
+        }
+    }
+
+    // Waits until every job of the group is done. Only the group's own
+    // counter is touched: other threads sleep on it, and helpers announce
+    // themselves in it so FinishGroupJob knows whether to look for them.
+    void WaitForGroup(detail::GroupState& group) noexcept
+    {
+        if (LocalState())
+        {
+            HelpUntil([&group] { return group.IsIdle(); }, [this, &group](WorkerState& local)
+                {
+                // Pairs with the exchange and load in FinishGroupJob
+                local.waitKey.store(&group, std::memory_order_relaxed);
+                group.helpers.fetch_add(1, std::memory_order_seq_cst);
+                Park(local, [&group] { return group.IsSettling(); });
+                group.helpers.fetch_sub(1, std::memory_order_relaxed);
+                local.waitKey.store(nullptr, std::memory_order_relaxed);
+                });
+            return;
+        }
+
+        for (;;)
+        {
+            int pending = group.pending.load(std::memory_order_acquire);
+            if (pending == 0)
+                return;
+            // Closing only lasts while the finisher wakes us
+            if (pending == detail::GroupState::Closing)
+                std::this_thread::yield();
+            else
+                group.pending.wait(pending, std::memory_order_acquire);
+        }
+    }
+
+    // Counts one job of the group as done. The last one wakes the waiters
+    // while the counter reads Closing, then releases the group with the
+    // final store.
+    void FinishGroupJob(detail::GroupState& group) noexcept
+    {
+        int pending = group.pending.load(std::memory_order_relaxed);
+        while (!group.pending.compare_exchange_weak(pending,
+            pending == 1 ? detail::GroupState::Closing : pending - 1, std::memory_order_seq_cst))
+        {
+        }
+        if (pending != 1)
+            return;
+
+        if (group.helpers.load(std::memory_order_seq_cst) != 0)
+            WakeHelpers(&group);
+        group.pending.notify_all();
+        group.pending.store(0, std::memory_order_release);
+    }
+
+    static void RunJob(Scheduler& scheduler, detail::WorkItem* item) noexcept
+    {
+        scheduler.Execute(static_cast<JobEntry*>(item));
+    }
+
+    void Execute(JobEntry* jobEntry) noexcept
+    {
+        if (jobEntry->token.IsCancellationRequested())
+        {
+            jobEntry->Fail(jobEntry->token.m_State->exception);
+        }
+        else if (!jobEntry->failed.load(std::memory_order_acquire))
+        {
+            try
+            {
+                jobEntry->job();
+            }
+            catch (...)
+            {
+                jobEntry->Fail(std::current_exception());
+            }
+        }
+
+        {
+            // Trigger dependents
+            std::unique_lock<std::mutex> depLock(jobEntry->depMutex);
+            jobEntry->finished.store(true, std::memory_order_release);
+            jobEntry->finished.notify_all();
+            if (jobEntry->future)
+                jobEntry->future->Fulfil(*jobEntry);
+
+            for (auto& dep : jobEntry->dependents) 
+            {
+                if (jobEntry->exception)
+                    dep->Fail(jobEntry->exception);
+                if (--dep->remainingDeps == 0)
+                    Enqueue(dep.Entry());
+            }
+            jobEntry->dependents.clear();
+
+            const bool helped = jobEntry->helpers != 0;
+            depLock.unlock();
+            if (helped)
+                WakeHelpers(jobEntry);
+        }
+        detail::GroupState* group = jobEntry->group;
+        if (group && jobEntry->exception)
+            group->Fail(jobEntry->exception);
+        jobEntry->Release();
+        if (group)
+            FinishGroupJob(*group);
+        Retire();
+    }
+
+    // Balances the count taken by Push once an item is done
+    void Retire() noexcept
+    {
+        if (m_ActiveJobCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            m_ActiveJobCount.notify_all();
+    }
+
+    // Shared by the graph types: resets the node counters, queues the roots,
+    // waits for every node and rethrows the first failure
+    template<typename Graph>
+    void RunGraph(Graph& graph)
+    {
+        graph.Freeze();
+        const auto& layout = graph.m_Layout;
+        const std::uint32_t count = layout.NodeCount();
+        if (count == 0)
+            return;
+        if (graph.m_Running.exchange(true, std::memory_order_acquire))
+            throw std::logic_error("TaskGraph: graph is already running");
+
+        for (std::uint32_t i = 0; i < count; i++)
+        {
+            graph.m_Nodes[i].pending.store(layout.inDegrees[i], std::memory_order_relaxed);
+            graph.m_Nodes[i].skipped.store(false, std::memory_order_relaxed);
+        }
+        graph.m_State.pending.store(static_cast<int>(count), std::memory_order_relaxed);
+
+        ReserveQueues(graph.m_Roots.size(), count);
+        if (!graph.m_Roots.empty())
+            EnqueueBatch(graph.m_Roots.data(), graph.m_Roots.size());
+
+        WaitForGroup(graph.m_State);
+        graph.m_Running.store(false, std::memory_order_release);
+
+        if (graph.m_State.failed.load(std::memory_order_acquire))
+        {
+            std::exception_ptr error = std::exchange(graph.m_State.exception, nullptr);
+            graph.m_State.failed.store(false, std::memory_order_relaxed);
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Sizes the queues for a graph running on its own, so only its first run
+    // on this scheduler may allocate. EnqueueBatch hands each inbox at most
+    // one chunk of roots, and no deque band ever holds more than every node
+    // (reserved up to MaxQueueReserve). Deques can only be grown by their
+    // owners, so a larger reserve is published and each worker is woken and
+    // waited for before the roots are queued.
+    void ReserveQueues(std::size_t roots, std::size_t nodes) noexcept
+    {
+        const std::size_t chunk = (roots + m_WorkerCount - 1) / m_WorkerCount;
+        std::size_t reserved = m_InboxReserve.load(std::memory_order_relaxed);
+        if (chunk > reserved)
+        {
+            for (auto& state : m_WorkerStates)
+            {
+                std::lock_guard<std::mutex> lock(state->inboxMutex);
+                state->inbox.reserve(chunk);
+            }
+            while (reserved < chunk && !m_InboxReserve.compare_exchange_weak(reserved, chunk, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        const std::size_t depth = std::min(nodes, MaxQueueReserve);
+        reserved = m_QueueReserve.load(std::memory_order_relaxed);
+        while (reserved < depth && !m_QueueReserve.compare_exchange_weak(reserved, depth, std::memory_order_release))
+        {
+        }
+
+        WorkerState* local = LocalState();
+        for (auto& state : m_WorkerStates)
+        {
+            if (state.get() == local)
+            {
+                ReserveLocalQueues(*local);
+                continue;
+            }
+            while (state->queueReserve.load(std::memory_order_acquire) < depth)
+            {
+                WakeWorker(*state);
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // Called by a graph node once it has run or been skipped: queues the
+    // successors it was the last dependency of, skipping them too if needed
+    template<typename Graph>
+    void FinishGraphNode(Graph& graph, std::uint32_t index, bool skipped) noexcept
+    {
+        const auto& layout = graph.m_Layout;
+        const std::uint32_t* successor = layout.successors.data() + layout.offsets[index];
+        const std::uint32_t* last = layout.successors.data() + layout.offsets[index + 1];
+        for (; successor != last; ++successor)
+        {
+            auto& next = graph.m_Nodes[*successor];
+            if (skipped)
+                next.skipped.store(true, std::memory_order_relaxed);
+            if (next.pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                Push(&next, -1);
+        }
+
+        // Past this the graph may already be destroyed
+        FinishGroupJob(graph.m_State);
+        Retire();
+    }
+
+    void Worker(size_t id) 
+    {
+        s_CurrentWorker = { this, static_cast<unsigned int>(id) };
+
+        while (!m_Stop) 
+        {
+            detail::WorkItem* item = FindWork(id);
+            if (!item)
+                item = WaitForWork(id);
+
+            if (item)
+                item->run(*this, item);
+        }
+
+        s_CurrentWorker = {};
+    }
+
+    JobEntry* AllocateEntry()
+    {
+        JobEntry* entry = nullptr;
+        if (WorkerState* local = LocalState())
+        {
+            if (!local->freeList)
+                RefillCache(*local);
+            entry = local->freeList;
+            local->freeList = entry->next;
+            local->freeCount--;
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(m_Pool->mutex);
+            if (!m_Pool->freeList)
+                AllocateSlab();
+            entry = m_Pool->freeList;
+            m_Pool->freeList = entry->next;
+        }
+
+        entry->next = nullptr;
+        entry->refCount.store(1, std::memory_order_relaxed);
+        return entry;
+    }
+
+    // Appends count fresh entries (one reference each) to out, taking the pool lock once
+    template<typename Handle>
+    void AllocateEntries(std::size_t count, std::vector<Handle>& out)
+    {
+        if (WorkerState* local = LocalState())
+        {
+            while (count > 0 && local->freeList)
+            {
+                JobEntry* entry = local->freeList;
+                local->freeList = entry->next;
+                local->freeCount--;
+                entry->next = nullptr;
+                entry->refCount.store(1, std::memory_order_relaxed);
+                out.push_back(Handle(JobHandle(entry)));
+                count--;
+            }
+        }
+
+        if (count == 0)
+            return;
+
+        std::lock_guard<std::mutex> lock(m_Pool->mutex);
+        for (; count > 0; count--)
+        {
+            if (!m_Pool->freeList)
+                AllocateSlab();
+            JobEntry* entry = m_Pool->freeList;
+            m_Pool->freeList = entry->next;
+            entry->next = nullptr;
+            entry->refCount.store(1, std::memory_order_relaxed);
+            out.push_back(Handle(JobHandle(entry)));
+        }
+    }
+
+    static void Recycle(JobEntry* entry) noexcept
+    {
+        // Drops captures and dependents; may recursively recycle other entries
+        entry->job = nullptr;
+        entry->dependents.clear();
+        entry->future.reset();
+        entry->exception = nullptr;
+        entry->failed.store(false, std::memory_order_relaxed);
+        entry->token = {};
+        entry->group = nullptr;
+        entry->affinity = -1;
+        entry->finished.store(false, std::memory_order_relaxed);
+        entry->remainingDeps.store(0, std::memory_order_relaxed);
+
+        // Only a worker of the entry's own scheduler, which is then still
+        // running, may keep it in its cache
+        Scheduler* current = s_CurrentWorker.scheduler;
+        if (current && current->m_Pool == entry->pool)
+        {
+            WorkerState& local = *current->m_WorkerStates[s_CurrentWorker.index];
+            entry->next = local.freeList;
+            local.freeList = entry;
+            if (++local.freeCount > 2 * PoolBatchSize)
+                current->FlushCache(local, PoolBatchSize);
+            return;
+        }
+
+        entry->pool->Push(*entry);
+    }
+
+    void RefillCache(WorkerState& local)
+    {
+        std::lock_guard<std::mutex> lock(m_Pool->mutex);
+        for (std::size_t i = 0; i < PoolBatchSize; i++)
+        {
+            if (!m_Pool->freeList)
+                AllocateSlab();
+            JobEntry* entry = m_Pool->freeList;
+            m_Pool->freeList = entry->next;
+            entry->next = local.freeList;
+            local.freeList = entry;
+        }
+        local.freeCount += PoolBatchSize;
+    }
+
+    void FlushCache(WorkerState& local, std::size_t count) noexcept
+    {
+        JobEntry* first = local.freeList;
+        JobEntry* last = first;
+        for (std::size_t i = 1; i < count; i++)
+            last = last->next;
+
+        local.freeList = last->next;
+        local.freeCount -= count;
+
+        std::lock_guard<std::mutex> lock(m_Pool->mutex);
+        last->next = m_Pool->freeList;
+        m_Pool->freeList = first;
+    }
+
+    // Caller holds the pool mutex
+    void AllocateSlab()
+    {
+        void* memory = m_Pool->resource->allocate(sizeof(JobEntry) * PoolSlabSize, alignof(JobEntry));
+        JobEntry* slab = static_cast<JobEntry*>(memory);
+        for (std::size_t i = 0; i < PoolSlabSize; i++)
+        {
+            JobEntry* entry = new (slab + i) JobEntry();
+            entry->scheduler = this;
+            entry->pool = m_Pool;
+            entry->next = m_Pool->freeList;
+            m_Pool->freeList = entry;
+        }
+        m_Pool->slabs.push_back(slab);
+    }
+
+    // Runs after Shutdown, so only handles held outside the scheduler can
+    // still reference entries; the pool stays around until they are released
+    void ReleasePool() noexcept
+    {
+        for (auto& state : m_WorkerStates)
+            if (state->freeCount > 0)
+                FlushCache(*state, state->freeCount);
+        m_Pool->Orphan();
+        m_Pool = nullptr;
+    }
+
+    unsigned int m_WorkerCount;
+    std::vector<std::thread> m_Workers;
+    std::vector<std::unique_ptr<WorkerState>> m_WorkerStates;
+    alignas(CacheLineSize) std::atomic<int> m_ActiveJobCount{ 0 }; // queued or running
+    alignas(CacheLineSize) std::atomic<int> m_Sleepers{ 0 };
+    alignas(CacheLineSize) std::atomic<bool> m_Stop;
+    std::atomic<std::size_t> m_InboxReserve{ InboxCapacity }; // raised by ReserveQueues
+    std::atomic<std::size_t> m_QueueReserve{ 0 };
+
+    EntryPool* m_Pool;
+};
+
+// Handle to a submitted job producing a T. Converts to Scheduler::JobHandle,
+// so tasks can be passed as dependencies of other jobs.
+template<typename T>
+class Task : public Scheduler::JobHandle
+{
+public:
+    Task() noexcept = default;
+
+    bool IsReady() const noexcept
+    {
+        return Entry()->finished.load(std::memory_order_acquire);
+    }
+
+    // See Scheduler::Wait, workers keep running other jobs meanwhile
+    void Wait() const noexcept
+    {
+        if (!IsReady())
+            Entry()->scheduler->Wait(*this);
+    }
+
+    // Whether the job threw, or was skipped because a dependency failed.
+    // Only meaningful once the task is ready.
+    bool HasFailed() const noexcept
+    {
+        return Entry()->failed.load(std::memory_order_acquire);
+    }
+
+    // Waits, then returns a reference to the result stored inside the job.
+    // Valid for as long as any handle to the job is alive. Rethrows the
+    // exception of the job or of the failed dependency that pruned it.
+    std::add_lvalue_reference_t<T> Get() const
+    {
+        Wait();
+        if (Entry()->exception)
+            std::rethrow_exception(Entry()->exception);
+        if constexpr (!std::is_void_v<T>)
+            return *static_cast<T*>(Entry()->job.Result());
+    }
+
+    std::future<T> GetFuture() const
+    {
+        return Scheduler::GetFuture(*this);
+    }
+
+private:
+    friend class Scheduler;
+
+    explicit Task(Scheduler::JobHandle handle) noexcept
+        : Scheduler::JobHandle(std::move(handle))
+    {
+    }
+};
+
+// Scoped set of jobs with its own outstanding counter, so a caller can wait
+// for just its own work instead of WaitAll. Waiters sleep on the group's own
+// counter and only its last job wakes them, so busy work elsewhere in the
+// scheduler never disturbs them. Groups nest: a job may run and wait on a group of its own, the
+// worker keeps helping while it waits.
+class TaskGroup
+{
+public:
+    explicit TaskGroup(Scheduler& scheduler) noexcept
+        : m_Scheduler(scheduler)
+    {
+    }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    // Jobs refer to the group, so it must not go away before they finish
+    ~TaskGroup()
+    {
+        WaitQuietly();
+    }
+
+    template<typename F>
+        requires std::is_invocable_v<std::decay_t<F>&>
+    auto Run(F&& job, int priority = 0, CancellationToken token = {}) noexcept
+    {
+        return m_Scheduler.SubmitToGroup(m_State, std::forward<F>(job), priority, std::move(token));
+    }
+
+    // Like Run, but queues the job on the given worker. It is a placement
+    // hint: other workers may still steal it when they run out of work.
+    template<typename F>
+        requires std::is_invocable_v<std::decay_t<F>&>
+    auto RunOn(unsigned int worker, F&& job, int priority = 0, CancellationToken token = {}) noexcept
+    {
+        return m_Scheduler.SubmitToGroup(m_State, std::forward<F>(job), priority, std::move(token), static_cast<int>(worker));
+    }
+
+    // Waits for every job run so far, helping on worker threads, then
+    // rethrows the first exception raised by one of them (if any). The
+    // group can be reused afterwards.
+    void Wait()
+    {
+        WaitQuietly();
+        if (m_State.failed.load(std::memory_order_acquire))
+        {
+            std::exception_ptr error = std::exchange(m_State.exception, nullptr);
+            m_State.failed.store(false, std::memory_order_relaxed);
+            std::rethrow_exception(error);
+        }
+    }
+
+    bool IsIdle() const noexcept
+    {
+        return m_State.IsIdle();
+    }
+
+private:
+    void WaitQuietly() noexcept
+    {
+        m_Scheduler.WaitForGroup(m_State);
+    }
+
+    Scheduler& m_Scheduler;
+    detail::GroupState m_State;
+};
+
+namespace detail {
+
+// Frozen edges of a task graph in compressed sparse row form: the successors
+// of node i are successors[offsets[i], offsets[i + 1]). 32-bit indices keep
+// graphs with tens of millions of edges small.
+struct GraphLayout
+{
+    using Edge = std::pair<std::uint32_t, std::uint32_t>;
+
+    // Node and edge limit, so indices fit 32 bits and node counts an int
+    static constexpr std::size_t MaxCount = 0x7FFFFFFF;
+
+    std::vector<std::uint32_t> offsets;
+    std::vector<std::uint32_t> successors;
+    std::vector<std::uint32_t> inDegrees;
+
+    // Throws std::logic_error if the edges form a cycle
+    void Build(std::uint32_t nodeCount, const std::vector<Edge>& edges)
+    {
+        std::vector<std::uint32_t> newOffsets(std::size_t(nodeCount) + 1, 0);
+        std::vector<std::uint32_t> newDegrees(nodeCount, 0);
+        for (auto& [before, after] : edges)
+        {
+            newOffsets[before + 1]++;
+            newDegrees[after]++;
+        }
+        for (std::uint32_t i = 0; i < nodeCount; i++)
+            newOffsets[i + 1] += newOffsets[i];
+
+        std::vector<std::uint32_t> fill(newOffsets.begin(), newOffsets.end() - 1);
+        std::vector<std::uint32_t> newSuccessors(edges.size());
+        for (auto& [before, after] : edges)
+            newSuccessors[fill[before]++] = after;
+
+        // Kahn's algorithm: every node must be reachable from the roots
+        fill = newDegrees;
+        std::vector<std::uint32_t> ready;
+        for (std::uint32_t i = 0; i < nodeCount; i++)
+            if (fill[i] == 0)
+                ready.push_back(i);
+        std::size_t visited = 0;
+        while (!ready.empty())
+        {
+            std::uint32_t node = ready.back();
+            ready.pop_back();
+            visited++;
+            for (std::uint32_t e = newOffsets[node]; e < newOffsets[node + 1]; e++)
+                if (--fill[newSuccessors[e]] == 0)
+                    ready.push_back(newSuccessors[e]);
+        }
+        if (visited != nodeCount)
+            throw std::logic_error("TaskGraph: dependency cycle");
+
+        offsets = std::move(newOffsets);
+        successors = std::move(newSuccessors);
+        inDegrees = std::move(newDegrees);
+    }
+
+    std::uint32_t NodeCount() const noexcept
+    {
+        return static_cast<std::uint32_t>(inDegrees.size());
+    }
+
+    std::size_t EdgeCount() const noexcept
+    {
+        return successors.size();
+    }
+
+    std::size_t Bytes() const noexcept
+    {
+        return (offsets.capacity() + successors.capacity() + inDegrees.capacity()) * sizeof(std::uint32_t);
+    }
+};
+
+} // namespace detail
+
+// Passes run by TaskGraph::Optimize
+struct GraphOptimizeOptions
+{
+    bool dropEmptyNodes = true;       // when bypassing them adds no edges
+    bool transitiveReduction = true;  // also drops duplicate edges
+    bool fuseChains = true;           // of nodes with the same priority
+};
+
+// Graph size around a TaskGraph::Optimize call
+struct GraphOptimizeReport
+{
+    std::size_t nodesBefore = 0;
+    std::size_t edgesBefore = 0;
+    std::size_t nodesAfter = 0;
+    std::size_t edgesAfter = 0;
+};
+
+// A dependency graph declared once and run many times. Nodes and edges are
+// added up front, Freeze lays them out in flat arrays, and each
+// Scheduler::Run(graph) only resets per-node counters and queues the roots.
+// Once the first run has reserved queue space, runs need no allocation, no
+// locks and no reference counting (for graphs of up to
+// Scheduler::MaxQueueReserve nodes). A node that throws skips everything
+// that (transitively) depends on it.
+class TaskGraph
+{
+public:
+    using NodeId = std::uint32_t;
+
+    TaskGraph() = default;
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+
+    template<typename F>
+        requires std::is_invocable_v<std::decay_t<F>&>
+    NodeId AddNode(F&& job, int priority = 0)
+    {
+        ThrowIfFrozen();
+        if (m_Jobs.size() >= detail::GraphLayout::MaxCount)
+            throw std::length_error("TaskGraph: too many nodes");
+        m_Jobs.emplace_back(std::forward<F>(job));
+        m_Priorities.push_back(priority);
+        return static_cast<NodeId>(m_Jobs.size() - 1);
+    }
+
+    // A node without a job, e.g. a join point between two groups of nodes
+    NodeId AddEmptyNode()
+    {
+        return AddNode(Scheduler::Job{});
+    }
+
+    // after runs only once before has finished
+    void AddEdge(NodeId before, NodeId after)
+    {
+        ThrowIfFrozen();
+        if (before >= m_Jobs.size() || after >= m_Jobs.size() || before == after)
+            throw std::invalid_argument("TaskGraph: invalid edge");
+        if (m_Edges.size() >= detail::GraphLayout::MaxCount)
+            throw std::length_error("TaskGraph: too many edges");
+        m_Edges.emplace_back(before, after);
+    }
+
+    // Builds the execution layout; the graph can't be changed afterwards.
+    // Throws std::logic_error if the edges form a cycle.
+    void Freeze()
+    {
+        if (m_Frozen)
+            return;
+
+        const auto count = static_cast<std::uint32_t>(m_Jobs.size());
+        detail::GraphLayout layout;
+        layout.Build(count, m_Edges);
+
+        auto nodes = std::make_unique<Node[]>(count);
+        std::vector<Node*> roots;
+        for (std::uint32_t i = 0; i < count; i++)
+        {
+            nodes[i].run = &RunNode;
+            nodes[i].priority = m_Priorities[i];
+            nodes[i].job = std::move(m_Jobs[i]);
+            nodes[i].graph = this;
+            if (layout.inDegrees[i] == 0)
+                roots.push_back(&nodes[i]);
+        }
+
+        m_Layout = std::move(layout);
+        m_Nodes = std::move(nodes);
+        m_Roots = std::move(roots);
+        std::vector<Scheduler::Job>().swap(m_Jobs);
+        std::vector<int>().swap(m_Priorities);
+        std::vector<detail::GraphLayout::Edge>().swap(m_Edges);
+        m_Frozen = true;
+    }
+
+    // Rewrites the declared graph into an equivalent, smaller one, then
+    // freezes it (node ids are meaningless afterwards):
+    //  - empty nodes are bypassed by linking their predecessors to their
+    //    successors, unless that would take more edges than it saves
+    //  - edges implied by longer paths (A->C next to A->B->C) are removed
+    //  - chains where A's only successor is B and B's only predecessor is A
+    //    become one node running A then B. They ran back to back anyway, so
+    //    this saves a queue round trip per link, which is what counts for
+    //    tiny jobs. A failure still skips the rest of the chain.
+    // Time is O(nodes * edges) in the worst case, meant for graphs built
+    // once and run many times.
+    GraphOptimizeReport Optimize(const GraphOptimizeOptions& options = {})
+    {
+        ThrowIfFrozen();
+        const auto count = static_cast<std::uint32_t>(m_Jobs.size());
+        GraphOptimizeReport report;
+        report.nodesBefore = count;
+        report.edgesBefore = m_Edges.size();
+
+        // Rejects cycles before anything is rewritten
+        detail::GraphLayout().Build(count, m_Edges);
+
+        std::vector<std::vector<std::uint32_t>> successors(count), predecessors(count);
+        for (auto& [before, after] : m_Edges)
+        {
+            successors[before].push_back(after);
+            predecessors[after].push_back(before);
+        }
+        std::vector<bool> alive(count, true);
+
+        if (options.dropEmptyNodes)
+            DropEmptyNodes(successors, predecessors, alive);
+        if (options.transitiveReduction)
+            ReduceTransitively(successors, predecessors, alive);
+        if (options.fuseChains)
+            FuseChains(successors, predecessors, alive);
+
+        // Renumber the surviving nodes in declaration order
+        std::vector<std::uint32_t> ids(count);
+        std::vector<Scheduler::Job> jobs;
+        std::vector<int> priorities;
+        for (std::uint32_t i = 0; i < count; i++)
+        {
+            if (!alive[i])
+                continue;
+            ids[i] = static_cast<std::uint32_t>(jobs.size());
+            jobs.push_back(std::move(m_Jobs[i]));
+            priorities.push_back(m_Priorities[i]);
+        }
+        std::vector<detail::GraphLayout::Edge> edges;
+        for (std::uint32_t i = 0; i < count; i++)
+        {
+            if (!alive[i])
+                continue;
+            std::sort(successors[i].begin(), successors[i].end());
+            successors[i].erase(std::unique(successors[i].begin(), successors[i].end()), successors[i].end());
+            for (std::uint32_t next : successors[i])
+                edges.emplace_back(ids[i], ids[next]);
+        }
+
+        m_Jobs = std::move(jobs);
+        m_Priorities = std::move(priorities);
+        m_Edges = std::move(edges);
+        report.nodesAfter = m_Jobs.size();
+        report.edgesAfter = m_Edges.size();
+        Freeze();
+        return report;
+    }
+
+    bool IsFrozen() const noexcept
+    {
+        return m_Frozen;
+    }
+
+    std::size_t NodeCount() const noexcept
+    {
+        return m_Frozen ? m_Layout.NodeCount() : m_Jobs.size();
+    }
+
+    std::size_t EdgeCount() const noexcept
+    {
+        return m_Frozen ? m_Layout.EdgeCount() : m_Edges.size();
+    }
+
+private:
+    friend class Scheduler;
+
+    struct Node : detail::WorkItem
+    {
+        Scheduler::Job job;
+        TaskGraph* graph = nullptr;
+
+        // Reset by every run
+        std::atomic<std::uint32_t> pending{ 0 };
+        std::atomic<bool> skipped{ false };
+    };
+
+    void ThrowIfFrozen() const
+    {
+        if (m_Frozen)
+            throw std::logic_error("TaskGraph: graph is frozen");
+    }
+
+    using AdjacencyLists = std::vector<std::vector<std::uint32_t>>;
+
+    static void Unlink(std::vector<std::uint32_t>& list, std::uint32_t node)
+    {
+        list.erase(std::remove(list.begin(), list.end(), node), list.end());
+    }
+
+    void DropEmptyNodes(AdjacencyLists& successors, AdjacencyLists& predecessors, std::vector<bool>& alive)
+    {
+        for (std::uint32_t node = 0; node < m_Jobs.size(); node++)
+        {
+            const std::size_t in = predecessors[node].size();
+            const std::size_t out = successors[node].size();
+            if (m_Jobs[node] || in * out > in + out)
+                continue;
+
+            for (std::uint32_t before : predecessors[node])
+            {
+                Unlink(successors[before], node);
+                successors[before].insert(successors[before].end(), successors[node].begin(), successors[node].end());
+            }
+            for (std::uint32_t after : successors[node])
+            {
+                Unlink(predecessors[after], node);
+                predecessors[after].insert(predecessors[after].end(), predecessors[node].begin(), predecessors[node].end());
+            }
+            successors[node].clear();
+            predecessors[node].clear();
+            alive[node] = false;
+        }
+    }
+
+    // Nodes in dependency order (the graph is known to be acyclic)
+    static std::vector<std::uint32_t> TopologicalOrder(const AdjacencyLists& successors,
+        const AdjacencyLists& predecessors, const std::vector<bool>& alive)
+    {
+        const auto count = static_cast<std::uint32_t>(successors.size());
+        std::vector<std::uint32_t> order, remaining(count);
+        for (std::uint32_t i = 0; i < count; i++)
+        {
+            remaining[i] = static_cast<std::uint32_t>(predecessors[i].size());
+            if (alive[i] && remaining[i] == 0)
+                order.push_back(i);
+        }
+        for (std::size_t i = 0; i < order.size(); i++)
+            for (std::uint32_t next : successors[order[i]])
+                if (--remaining[next] == 0)
+                    order.push_back(next);
+        return order;
+    }
+
+    // A direct successor is redundant if another successor reaches it.
+    // Reachability only grows along the topological order, so visiting the
+    // successors in that order and marking everything reachable from the
+    // kept ones finds all of them.
+    static void ReduceTransitively(AdjacencyLists& successors, AdjacencyLists& predecessors, const std::vector<bool>& alive)
+    {
+        const auto count = static_cast<std::uint32_t>(successors.size());
+        std::vector<std::uint32_t> rank(count);
+        std::vector<std::uint32_t> order = TopologicalOrder(successors, predecessors, alive);
+        for (std::uint32_t i = 0; i < order.size(); i++)
+            rank[order[i]] = i;
+
+        std::vector<std::uint32_t> mark(count, 0), stack;
+        for (std::uint32_t node : order)
+        {
+            auto& direct = successors[node];
+            std::sort(direct.begin(), direct.end(), [&rank](std::uint32_t a, std::uint32_t b) { return rank[a] < rank[b]; });
+
+            std::size_t kept = 0;
+            for (std::uint32_t next : direct)
+            {
+                if (mark[next] == node + 1)
+                    continue;
+                direct[kept++] = next;
+
+                stack.push_back(next);
+                while (!stack.empty())
+                {
+                    std::uint32_t reached = stack.back();
+                    stack.pop_back();
+                    if (mark[reached] == node + 1)
+                        continue;
+                    mark[reached] = node + 1;
+                    stack.insert(stack.end(), successors[reached].begin(), successors[reached].end());
+                }
+            }
+            direct.resize(kept);
+        }
+
+        for (auto& list : predecessors)
+            list.clear();
+        for (std::uint32_t node : order)
+            for (std::uint32_t next : successors[node])
+                predecessors[next].push_back(node);
+    }
+
+    void FuseChains(AdjacencyLists& successors, AdjacencyLists& predecessors, std::vector<bool>& alive)
+    {
+        auto fusable = [&](std::uint32_t node)
+        {
+            if (successors[node].size() != 1)
+                return false;
+            std::uint32_t next = successors[node][0];
+            return predecessors[next].size() == 1 && m_Priorities[next] == m_Priorities[node];
+        };
+
+        for (std::uint32_t head : TopologicalOrder(successors, predecessors, alive))
+        {
+            if (!alive[head] || !fusable(head))
+                continue;
+
+            std::vector<Scheduler::Job> chain;
+            if (m_Jobs[head])
+                chain.push_back(std::move(m_Jobs[head]));
+            std::uint32_t tail = head;
+            while (fusable(tail))
+            {
+                std::uint32_t next = successors[tail][0];
+                if (m_Jobs[next])
+                    chain.push_back(std::move(m_Jobs[next]));
+                if (tail != head)
+                    successors[tail].clear();
+                predecessors[next].clear();
+                alive[next] = false;
+                tail = next;
+            }
+
+            successors[head] = std::move(successors[tail]);
+            for (std::uint32_t after : successors[head])
+                std::replace(predecessors[after].begin(), predecessors[after].end(), tail, head);
+
+            if (chain.size() == 1)
+                m_Jobs[head] = std::move(chain[0]);
+            else if (chain.size() > 1)
+                m_Jobs[head] = [jobs = std::move(chain)]() mutable
+                {
+                    for (auto& job : jobs)
+                        job();
+                };
+        }
+    }
+
+    static void RunNode(Scheduler& scheduler, detail::WorkItem* item) noexcept
+    {
+        Node& node = *static_cast<Node*>(item);
+        TaskGraph& graph = *node.graph;
+
+        bool skipped = node.skipped.load(std::memory_order_relaxed);
+        if (!skipped && node.job)
+        {
+            try
+            {
+                node.job();
+            }
+            catch (...)
+            {
+                graph.m_State.Fail(std::current_exception());
+                skipped = true;
+            }
+        }
+
+        scheduler.FinishGraphNode(graph, static_cast<std::uint32_t>(&node - graph.m_Nodes.get()), skipped);
+    }
+
+    // Declared nodes and edges, consumed by Freeze
+    std::vector<Scheduler::Job> m_Jobs;
+    std::vector<int> m_Priorities;
+    std::vector<detail::GraphLayout::Edge> m_Edges;
+
+    // Frozen layout
+    bool m_Frozen = false;
+    detail::GraphLayout m_Layout;
+    std::unique_ptr<Node[]> m_Nodes;
+    std::vector<Node*> m_Roots;
+
+    // Per run: nodes left to finish and the first failure
+    detail::GroupState m_State;
+    std::atomic<bool> m_Running{ false };
+};
+
+inline void Scheduler::Run(TaskGraph& graph)
+{
+    RunGraph(graph);
+}
+
+// Frozen graph for millions of nodes that all run the same body(NodeId).
+// With no job stored per node, a node is a 32-byte state record in one
+// array, and Run executes straight from that array and the 32-bit CSR edges:
+// about 40 bytes per node and 4 per edge. Otherwise it behaves like
+// TaskGraph. The body is called from several workers at once.
+template<typename Body>
+class CompactTaskGraph
+{
+public:
+    using NodeId = std::uint32_t;
+
+    CompactTaskGraph(std::size_t nodeCount, Body body)
+        : m_NodeCount(static_cast<std::uint32_t>(nodeCount)), m_Body(std::move(body))
+    {
+        if (nodeCount > detail::GraphLayout::MaxCount)
+            throw std::length_error("CompactTaskGraph: too many nodes");
+    }
+
+    CompactTaskGraph(const CompactTaskGraph&) = delete;
+    CompactTaskGraph& operator=(const CompactTaskGraph&) = delete;
+
+    // Edges are staged as 8-byte pairs until Freeze
+    void ReserveEdges(std::size_t count)
+    {
+        m_Edges.reserve(count);
+    }
+
+    // after runs only once before has finished
+    void AddEdge(NodeId before, NodeId after)
+    {
+        if (m_Frozen)
+            throw std::logic_error("CompactTaskGraph: graph is frozen");
+        if (before >= m_NodeCount || after >= m_NodeCount || before == after)
+            throw std::invalid_argument("CompactTaskGraph: invalid edge");
+        if (m_Edges.size() >= detail::GraphLayout::MaxCount)
+            throw std::length_error("CompactTaskGraph: too many edges");
+        m_Edges.emplace_back(before, after);
+    }
+
+    // Throws std::logic_error if the edges form a cycle
+    void Freeze()
+    {
+        if (m_Frozen)
+            return;
+
+        detail::GraphLayout layout;
+        layout.Build(m_NodeCount, m_Edges);
+        std::vector<detail::GraphLayout::Edge>().swap(m_Edges);
+
+        auto nodes = std::make_unique<Node[]>(m_NodeCount);
+        std::vector<Node*> roots;
+        for (std::uint32_t i = 0; i < m_NodeCount; i++)
+        {
+            nodes[i].run = &RunNode;
+            nodes[i].graph = this;
+            if (layout.inDegrees[i] == 0)
+                roots.push_back(&nodes[i]);
+        }
+
+        m_Layout = std::move(layout);
+        m_Nodes = std::move(nodes);
+        m_Roots = std::move(roots);
+        m_Frozen = true;
+    }
+
+    bool IsFrozen() const noexcept
+    {
+        return m_Frozen;
+    }
+
+    std::size_t NodeCount() const noexcept
+    {
+        return m_NodeCount;
+    }
+
+    std::size_t EdgeCount() const noexcept
+    {
+        return m_Frozen ? m_Layout.EdgeCount() : m_Edges.size();
+    }
+
+    // Bytes held by the frozen layout: node states, CSR arrays and roots
+    std::size_t MemoryBytes() const noexcept
+    {
+        if (!m_Frozen)
+            return 0;
+        return m_NodeCount * sizeof(Node) + m_Layout.Bytes() + m_Roots.capacity() * sizeof(Node*);
+    }
+
+private:
+    friend class Scheduler;
+
+    struct Node : detail::WorkItem
+    {
+        CompactTaskGraph* graph = nullptr;
+        std::atomic<std::uint32_t> pending{ 0 };
+        std::atomic<bool> skipped{ false };
+    };
+
+    static void RunNode(Scheduler& scheduler, detail::WorkItem* item) noexcept
+    {
+        Node& node = *static_cast<Node*>(item);
+        CompactTaskGraph& graph = *node.graph;
+        const auto index = static_cast<std::uint32_t>(&node - graph.m_Nodes.get());
+
+        bool skipped = node.skipped.load(std::memory_order_relaxed);
+        if (!skipped)
+        {
+            try
+            {
+                graph.m_Body(index);
+            }
+            catch (...)
+            {
+                graph.m_State.Fail(std::current_exception());
+                skipped = true;
+            }
+        }
+
+        scheduler.FinishGraphNode(graph, index, skipped);
+    }
+
+    std::uint32_t m_NodeCount;
+    Body m_Body;
+    std::vector<detail::GraphLayout::Edge> m_Edges;
+
+    bool m_Frozen = false;
+    detail::GraphLayout m_Layout;
+    std::unique_ptr<Node[]> m_Nodes;
+    std::vector<Node*> m_Roots;
+
+    detail::GroupState m_State;
+    std::atomic<bool> m_Running{ false };
+};
+
+// Dependency of a StaticGraph: node after runs only once node before has finished
+struct StaticEdge
+{
+    std::size_t before = 0;
+    std::size_t after = 0;
+};
+
+namespace detail {
+
+// GraphLayout worked out at compile time for a StaticGraph, plus a
+// topological order that starts with the roots
+template<std::size_t NodeCount_, std::size_t EdgeCount_>
+struct StaticLayout
+{
+    std::array<std::uint32_t, NodeCount_ + 1> offsets{};
+    std::array<std::uint32_t, EdgeCount_> successors{};
+    std::array<std::uint32_t, NodeCount_> inDegrees{};
+    std::array<std::uint32_t, NodeCount_> order{};
+    std::size_t rootCount = 0;
+    bool validEdges = true;
+    bool acyclic = true;
+
+    constexpr std::uint32_t NodeCount() const noexcept
+    {
+        return static_cast<std::uint32_t>(NodeCount_);
+    }
+
+    static constexpr StaticLayout Build(const std::array<StaticEdge, EdgeCount_>& edges)
+    {
+        StaticLayout layout;
+        for (const StaticEdge& edge : edges)
+        {
+            if (edge.before >= NodeCount_ || edge.after >= NodeCount_ || edge.before == edge.after)
+            {
+                layout.validEdges = false;
+                return layout;
+            }
+            layout.offsets[edge.before + 1]++;
+            layout.inDegrees[edge.after]++;
+        }
+        for (std::size_t i = 0; i < NodeCount_; i++)
+            layout.offsets[i + 1] += layout.offsets[i];
+
+        std::array<std::uint32_t, NodeCount_ + 1> fill = layout.offsets;
+        for (const StaticEdge& edge : edges)
+            layout.successors[fill[edge.before]++] = static_cast<std::uint32_t>(edge.after);
+
+        // Kahn's algorithm, appending to order as nodes become ready
+        std::array<std::uint32_t, NodeCount_> remaining = layout.inDegrees;
+        std::size_t size = 0;
+        for (std::size_t i = 0; i < NodeCount_; i++)
+            if (remaining[i] == 0)
+                layout.order[size++] = static_cast<std::uint32_t>(i);
+        layout.rootCount = size;
+        for (std::size_t i = 0; i < size; i++)
+        {
+            std::uint32_t node = layout.order[i];
+            for (std::uint32_t e = layout.offsets[node]; e < layout.offsets[node + 1]; e++)
+                if (--remaining[layout.successors[e]] == 0)
+                    layout.order[size++] = layout.successors[e];
+        }
+        layout.acyclic = size == NodeCount_;
+        return layout;
+    }
+};
+
+} // namespace detail
+
+// A small fixed graph whose shape is a compile-time constant: node i runs
+// the i-th job and Edges is a constexpr std::array<StaticEdge, N>. In-degrees,
+// successor lists and the roots are computed by the compiler (a bad edge or
+// a cycle fails to compile), and the jobs, per-node counters and queue links
+// all live inside the object, so running it needs no job entries. Up to 256
+// nodes it never allocates either, since the scheduler's queues start out
+// that large (see Scheduler::InboxCapacity). Runs on the Scheduler's workers
+// like TaskGraph, with the same failure and waiting rules.
+template<auto Edges, typename... Jobs>
+class StaticGraph
+{
+    using Layout = detail::StaticLayout<sizeof...(Jobs), Edges.size()>;
+    static constexpr Layout m_Layout = Layout::Build(Edges);
+    static_assert(m_Layout.validEdges, "StaticGraph: edge names a missing node or the node itself");
+    static_assert(m_Layout.acyclic, "StaticGraph: dependency cycle");
+
+public:
+    explicit StaticGraph(Jobs... jobs)
+        : m_Jobs(std::move(jobs)...)
+    {
+        Link(std::index_sequence_for<Jobs...>{});
+    }
+
+    // Nodes point back at the graph, so it stays where it was built
+    StaticGraph(const StaticGraph&) = delete;
+    StaticGraph& operator=(const StaticGraph&) = delete;
+
+    static constexpr std::size_t NodeCount() noexcept
+    {
+        return sizeof...(Jobs);
+    }
+
+    static constexpr std::size_t EdgeCount() noexcept
+    {
+        return Edges.size();
+    }
+
+private:
+    friend class Scheduler;
+
+    struct Node : detail::WorkItem
+    {
+        StaticGraph* graph = nullptr;
+        std::atomic<std::uint32_t> pending{ 0 };
+        std::atomic<bool> skipped{ false };
+    };
+
+    template<std::size_t... I>
+    void Link(std::index_sequence<I...>) noexcept
+    {
+        ((m_Nodes[I].run = &RunNode<I>, m_Nodes[I].graph = this), ...);
+        for (std::size_t i = 0; i < m_Layout.rootCount; i++)
+            m_Roots[i] = &m_Nodes[m_Layout.order[i]];
+    }
+
+    // Laid out at compile time
+    void Freeze() noexcept
+    {
+    }
+
+    template<std::size_t I>
+    static void RunNode(Scheduler& scheduler, detail::WorkItem* item) noexcept
+    {
+        Node& node = *static_cast<Node*>(item);
+        StaticGraph& graph = *node.graph;
+
+        bool skipped = node.skipped.load(std::memory_order_relaxed);
+        if (!skipped)
+        {
+            try
+            {
+                std::get<I>(graph.m_Jobs)();
+            }
+            catch (...)
+            {
+                graph.m_State.Fail(std::current_exception());
+                skipped = true;
+            }
+        }
+
+        scheduler.FinishGraphNode(graph, static_cast<std::uint32_t>(I), skipped);
+    }
+
+    std::tuple<Jobs...> m_Jobs;
+    std::array<Node, sizeof...(Jobs)> m_Nodes;
+    std::array<Node*, m_Layout.rootCount> m_Roots{};
+
+    detail::GroupState m_State;
+    std::atomic<bool> m_Running{ false };
+};
+
+// Builds a StaticGraph in place, deducing the job types
+template<auto Edges, typename... Jobs>
+StaticGraph<Edges, std::decay_t<Jobs>...> MakeStaticGraph(Jobs&&... jobs)
+{
+    return StaticGraph<Edges, std::decay_t<Jobs>...>(std::forward<Jobs>(jobs)...);
+}
+
+// Partitioners for ParallelFor and the algorithms built on it.
+
+// One equal, contiguous piece per worker. Lowest overhead for uniform work.
+struct StaticPartitioner
+{
+};
+
+// Workers repeatedly grab grainSize iterations from a shared atomic counter.
+// Good for irregular work. 0 picks a grain from the range and worker count.
+struct DynamicPartitioner
+{
+    std::size_t grainSize = 0;
+};
+
+// One piece per worker, each split in half lazily whenever the worker running
+// it finds its own deque empty (thieves took what it offered). 0 picks a grain.
+struct AutoPartitioner
+{
+    std::size_t grainSize = 0;
+};
+
+// Fixed-size leaves whose layout depends on the range size alone, never on the
+// worker count or on who stole what. Reductions combine the leaves in a fixed
+// tree, so results are bit-identical run to run. 0 picks the leaf size.
+struct DeterministicPartitioner
+{
+    std::size_t leafSize = 0;
+};
+
+// Remembers which worker each chunk of a loop belongs to and routes the chunk
+// back to that worker's queue on the next run, so the data it left in that
+// core's caches gets reused. Idle workers still steal routed chunks, but a
+// chunk only changes owner when its owner missed a whole loop (see
+// Rebalance). Keep one object per loop and pass it to every run; the mapping
+// restarts if the range size or worker count changes. 0 picks a grain.
+class AffinityPartitioner
+{
+public:
+    explicit AffinityPartitioner(std::size_t grainSize = 0) noexcept
+        : m_GrainSize(grainSize)
+    {
+    }
+
+    AffinityPartitioner(const AffinityPartitioner&) = delete;
+    AffinityPartitioner& operator=(const AffinityPartitioner&) = delete;
+
+    // Worker each chunk will be queued on by the next loop, empty before the first
+    const std::vector<unsigned int>& Placement() const noexcept
+    {
+        return m_Workers;
+    }
+
+private:
+    template<std::integral Index, typename Body>
+    friend void ParallelFor(Scheduler& scheduler, Index begin, Index end, Body&& body, AffinityPartitioner& partitioner);
+
+    // A stolen chunk only follows its thief if the recorded owner ran none of
+    // its chunks (it was busy elsewhere for the whole loop), and only while the
+    // thief stays within one chunk of its fair share. Thieves taking the tail
+    // of a loop don't move anything, and placement can't pile up on a worker.
+    void Rebalance()
+    {
+        const std::size_t chunks = m_Workers.size();
+        const std::size_t cap = (chunks + m_WorkerCount - 1) / m_WorkerCount + 1;
+
+        m_Loads.assign(m_WorkerCount, 0);
+        m_RanOwn.assign(m_WorkerCount, false);
+        for (std::size_t k = 0; k < chunks; k++)
+        {
+            m_Loads[m_Workers[k]]++;
+            if (m_RanOn[k] == m_Workers[k])
+                m_RanOwn[m_Workers[k]] = true;
+        }
+
+        for (std::size_t k = 0; k < chunks; k++)
+        {
+            const unsigned int owner = m_Workers[k];
+            const unsigned int thief = m_RanOn[k];
+            if (thief != owner && !m_RanOwn[owner] && m_Loads[thief] < cap)
+            {
+                m_Loads[owner]--;
+                m_Loads[thief]++;
+                m_Workers[k] = thief;
+            }
+        }
+    }
+
+    std::size_t m_GrainSize;
+    std::size_t m_Count = 0;
+    std::size_t m_WorkerCount = 0;
+    std::vector<unsigned int> m_Workers; // chunk -> worker it is queued on
+    std::vector<unsigned int> m_RanOn;   // chunk -> worker that ran it this loop
+    std::vector<std::size_t> m_Loads;
+    std::vector<bool> m_RanOwn;
+};
+
+namespace detail {
+
+// Bodies take either one index or a [begin, end) subrange
+template<typename Index, typename Body>
+void InvokeRange(Body& body, Index begin, Index end)
+{
+    if constexpr (std::is_invocable_v<Body&, Index, Index>)
+    {
+        body(begin, end);
+    }
+    else
+    {
+        for (Index i = begin; i < end; ++i)
+            body(i);
+    }
+}
+
+inline std::size_t LeafSize(std::size_t count, DeterministicPartitioner partitioner) noexcept
+{
+    constexpr std::size_t MinLeafSize = 256;
+    constexpr std::size_t MaxLeafCount = 4096;
+    if (partitioner.leafSize)
+        return partitioner.leafSize;
+    return std::max(MinLeafSize, (count + MaxLeafCount - 1) / MaxLeafCount);
+}
+
+// Start of piece i when count iterations are cut into pieces near-equal parts
+inline std::size_t PieceBegin(std::size_t count, std::size_t pieces, std::size_t i) noexcept
+{
+    return count / pieces * i + std::min(i, count % pieces);
+}
+
+template<typename Index, typename Body>
+struct LazySplitter
+{
+    Scheduler& scheduler;
+    Body& body;
+    std::size_t grain;
+    TaskGroup group{ scheduler }; // last, so it is torn down (and waited on) first
+
+    void Run(Index begin, Index end)
+    {
+        while (static_cast<std::size_t>(end - begin) > grain)
+        {
+            if (scheduler.IsLocalQueueEmpty())
+            {
+                Index middle = begin + (end - begin) / 2;
+                group.Run([this, middle, end]() { Run(middle, end); });
+                end = middle;
+            }
+            else
+            {
+                Index next = begin + static_cast<Index>(grain);
+                InvokeRange(body, begin, next);
+                begin = next;
+            }
+        }
+        InvokeRange(body, begin, end);
+    }
+};
+
+} // namespace detail
+
+// Calls body(i) for every i in [begin, end), or body(subBegin, subEnd) on
+// disjoint subranges if the body takes two indices. The calling thread runs
+// a share of the work and returns once all of it is done; exceptions thrown
+// by the body are rethrown here.
+template<std::integral Index, typename Body, typename Partitioner = AutoPartitioner>
+void ParallelFor(Scheduler& scheduler, Index begin, Index end, Body&& body, Partitioner partitioner = {})
+{
+    if (!(begin < end))
+        return;
+
+    const std::size_t count = static_cast<std::size_t>(end - begin);
+    const std::size_t workers = scheduler.WorkerCount();
+    if (workers <= 1 || count == 1)
+    {
+        if constexpr (std::is_same_v<Partitioner, DeterministicPartitioner>)
+        {
+            // Range bodies still see the same leaves as with more workers
+            const std::size_t leaf = detail::LeafSize(count, partitioner);
+            for (std::size_t first = 0; first < count; first += leaf)
+            {
+                std::size_t last = std::min(first + leaf, count);
+                detail::InvokeRange(body, begin + static_cast<Index>(first), begin + static_cast<Index>(last));
+            }
+        }
+        else
+        {
+            detail::InvokeRange(body, begin, end);
+        }
+        return;
+    }
+
+    auto pieceBegin = [&](std::size_t pieces, std::size_t i)
+    {
+        return begin + static_cast<Index>(detail::PieceBegin(count, pieces, i));
+    };
+
+    // Each branch declares its group after the state its helpers use, so a
+    // throwing inline share still waits for them before that state goes away
+    if constexpr (std::is_same_v<Partitioner, StaticPartitioner>)
+    {
+        TaskGroup group(scheduler);
+        const std::size_t pieces = std::min(count, workers);
+        for (std::size_t i = 1; i < pieces; i++)
+        {
+            Index first = pieceBegin(pieces, i);
+            Index last = pieceBegin(pieces, i + 1);
+            group.Run([&body, first, last]() { detail::InvokeRange(body, first, last); });
+        }
+        detail::InvokeRange(body, begin, pieceBegin(pieces, 1));
+        group.Wait();
+    }
+    else if constexpr (std::is_same_v<Partitioner, DynamicPartitioner> || std::is_same_v<Partitioner, DeterministicPartitioner>)
+    {
+        std::size_t grain;
+        if constexpr (std::is_same_v<Partitioner, DeterministicPartitioner>)
+            grain = detail::LeafSize(count, partitioner);
+        else
+            grain = partitioner.grainSize ? partitioner.grainSize : std::max<std::size_t>(1, count / (workers * 8));
+        std::atomic<std::size_t> next{ 0 };
+
+        auto drain = [&]()
+        {
+            for (;;)
+            {
+                std::size_t first = next.fetch_add(grain, std::memory_order_relaxed);
+                if (first >= count)
+                    return;
+                std::size_t last = std::min(first + grain, count);
+                detail::InvokeRange(body, begin + static_cast<Index>(first), begin + static_cast<Index>(last));
+            }
+        };
+
+        TaskGroup group(scheduler);
+        const std::size_t helpers = std::min(workers, (count + grain - 1) / grain) - 1;
+        for (std::size_t i = 0; i < helpers; i++)
+            group.Run(drain);
+        drain();
+        group.Wait();
+    }
+    else
+    {
+        static_assert(std::is_same_v<Partitioner, AutoPartitioner>, "unknown partitioner");
+
+        const std::size_t grain = partitioner.grainSize ? partitioner.grainSize
+            : std::max<std::size_t>(1, count / (workers * 16));
+        detail::LazySplitter<Index, std::remove_reference_t<Body>> splitter{ scheduler, body, grain };
+
+        const std::size_t pieces = std::min(workers, (count + grain - 1) / grain);
+        for (std::size_t i = 1; i < pieces; i++)
+        {
+            Index first = pieceBegin(pieces, i);
+            Index last = pieceBegin(pieces, i + 1);
+            splitter.group.Run([&splitter, first, last]() { splitter.Run(first, last); });
+        }
+        splitter.Run(begin, pieceBegin(pieces, 1));
+        splitter.group.Wait();
+    }
+}
+
+// ParallelFor that replays the chunk-to-worker mapping recorded by the
+// partitioner on its previous runs
+template<std::integral Index, typename Body>
+void ParallelFor(Scheduler& scheduler, Index begin, Index end, Body&& body, AffinityPartitioner& partitioner)
+{
+    if (!(begin < end))
+        return;
+
+    const std::size_t count = static_cast<std::size_t>(end - begin);
+    const std::size_t workers = scheduler.WorkerCount();
+    if (workers <= 1 || count == 1)
+    {
+        detail::InvokeRange(body, begin, end);
+        return;
+    }
+
+    const std::size_t grain = partitioner.m_GrainSize ? partitioner.m_GrainSize
+        : std::max<std::size_t>(1, count / (workers * 4));
+    const std::size_t chunks = (count + grain - 1) / grain;
+
+    if (partitioner.m_Count != count || partitioner.m_WorkerCount != workers || partitioner.m_Workers.size() != chunks)
+    {
+        // First run: contiguous runs of chunks per worker, like the static partitioner
+        partitioner.m_Workers.resize(chunks);
+        for (std::size_t k = 0; k < chunks; k++)
+            partitioner.m_Workers[k] = static_cast<unsigned int>(k * workers / chunks);
+        partitioner.m_Count = count;
+        partitioner.m_WorkerCount = workers;
+    }
+    partitioner.m_RanOn.assign(partitioner.m_Workers.begin(), partitioner.m_Workers.end());
+
+    TaskGroup group(scheduler);
+    for (std::size_t k = 0; k < chunks; k++)
+    {
+        group.RunOn(partitioner.m_Workers[k], [&, k]()
+        {
+            Index first = begin + static_cast<Index>(k * grain);
+            Index last = begin + static_cast<Index>(std::min(count, (k + 1) * grain));
+            detail::InvokeRange(body, first, last);
+
+            int worker = scheduler.CurrentWorkerIndex();
+            if (worker >= 0)
+                partitioner.m_RanOn[k] = static_cast<unsigned int>(worker);
+        });
+    }
+    group.Wait();
+    partitioner.Rebalance();
+}
+
+namespace detail {
+
+template<typename T>
+struct alignas(CacheLineSize) CachePadded
+{
+    T value;
+};
+
+// Combines slot(0) .. slot(count - 1), each an std::optional, pairwise into
+// slot(0). The tree shape depends only on count.
+template<typename Slot, typename Combine>
+void TreeCombine(std::size_t count, Slot slot, Combine& combine)
+{
+    for (std::size_t stride = 1; stride < count; stride *= 2)
+    {
+        for (std::size_t i = 0; i + stride < count; i += 2 * stride)
+        {
+            auto& left = slot(i);
+            auto& right = slot(i + stride);
+            if (!right)
+                continue;
+            if (left)
+                *left = combine(std::move(*left), std::move(*right));
+            else
+                left = std::move(right);
+        }
+    }
+}
+
+// Reduces map(i) over [begin, end) into one partial per worker (plus one for
+// the calling thread if it is not a worker). Chunks start from their first
+// element, so no identity is needed and the inner loop is a plain fold the
+// compiler can vectorise. Empty if the range is.
+template<typename T, typename Index, typename Map, typename Combine, typename Partitioner>
+std::optional<T> ReduceRange(Scheduler& scheduler, Index begin, Index end, Map& map, Combine& combine, Partitioner partitioner)
+{
+    auto foldChunk = [&](Index first, Index last)
+    {
+        T acc = map(first);
+        for (Index i = first + 1; i < last; ++i)
+            acc = combine(std::move(acc), map(i));
+        return acc;
+    };
+
+    if constexpr (std::is_same_v<Partitioner, DeterministicPartitioner>)
+    {
+        // One result per leaf, combined in a tree fixed by the range size
+        if (!(begin < end))
+            return std::nullopt;
+
+        const std::size_t count = static_cast<std::size_t>(end - begin);
+        const std::size_t leaf = LeafSize(count, partitioner);
+        std::vector<std::optional<T>> leaves((count + leaf - 1) / leaf);
+
+        ParallelFor(scheduler, std::size_t(0), leaves.size(), [&](std::size_t index)
+        {
+            std::size_t first = index * leaf;
+            std::size_t last = std::min(first + leaf, count);
+            leaves[index].emplace(foldChunk(begin + static_cast<Index>(first), begin + static_cast<Index>(last)));
+        }, AutoPartitioner{ 1 });
+
+        TreeCombine(leaves.size(), [&](std::size_t i) -> std::optional<T>& { return leaves[i]; }, combine);
+        return std::move(leaves[0]);
+    }
+
+    std::vector<CachePadded<std::optional<T>>> partials(scheduler.WorkerCount() + 1);
+
+    ParallelFor(scheduler, begin, end, [&](Index first, Index last)
+    {
+        T acc = foldChunk(first, last);
+
+        // Slot 0 is the calling thread; a slot is only ever touched by its own thread
+        std::optional<T>& slot = partials[scheduler.CurrentWorkerIndex() + 1].value;
+        if (slot)
+            *slot = combine(std::move(*slot), std::move(acc));
+        else
+            slot.emplace(std::move(acc));
+    }, partitioner);
+
+    TreeCombine(partials.size(), [&](std::size_t i) -> std::optional<T>& { return partials[i].value; }, combine);
+    return std::move(partials[0].value);
+}
+
+} // namespace detail
+
+// Combines map(i) for every i in [begin, end) with combine, starting from
+// identity. combine must be associative and commutative: partials are kept per
+// worker and merged in whatever order chunks happened to run. With a
+// DeterministicPartitioner it only needs to be associative, and the result is
+// the same for any worker count.
+template<std::integral Index, typename T, typename Map, typename Combine, typename Partitioner = AutoPartitioner>
+T ParallelReduce(Scheduler& scheduler, Index begin, Index end, T identity, Map&& map, Combine&& combine, Partitioner partitioner = {})
+{
+    std::optional<T> result = detail::ReduceRange<T>(scheduler, begin, end, map, combine, partitioner);
+    return result ? combine(std::move(identity), std::move(*result)) : identity;
+}
+
+// Parallel std::transform_reduce: reduce(init, transform(x)...) over [first, last).
+// Same requirements on reduce as ParallelReduce.
+template<std::random_access_iterator It, typename T, typename Reduce, typename Transform, typename Partitioner = AutoPartitioner>
+T TransformReduce(Scheduler& scheduler, It first, It last, T init, Reduce&& reduce, Transform&& transform, Partitioner partitioner = {})
+{
+    using Index = std::iter_difference_t<It>;
+    auto map = [&](Index i) -> T { return transform(first[i]); };
+    std::optional<T> result = detail::ReduceRange<T>(scheduler, Index(0), last - first, map, reduce, partitioner);
+    return result ? reduce(std::move(init), std::move(*result)) : init;
+}
+
+namespace detail {
+
+// Splits count elements into blocks sized from count alone, so passes over
+// the same data agree on the layout whatever the worker count
+struct Blocks
+{
+    std::size_t size;
+    std::size_t count;
+
+    static Blocks For(std::size_t elements) noexcept
+    {
+        constexpr std::size_t MinBlockSize = 4096;
+        constexpr std::size_t MaxBlockCount = 1024;
+        std::size_t size = std::max(MinBlockSize, (elements + MaxBlockCount - 1) / MaxBlockCount);
+        return Blocks{ size, (elements + size - 1) / size };
+    }
+};
+
+// Scans count elements from in into out, continuing from running. Returns the
+// running value after the last element.
+template<bool Exclusive, typename T, typename InIt, typename OutIt, typename Op>
+T ScanSequential(InIt in, OutIt out, std::size_t count, T running, Op& op)
+{
+    for (std::size_t i = 0; i < count; i++)
+    {
+        if constexpr (Exclusive)
+        {
+            T next = op(running, in[i]); // read before writing, out may alias in
+            out[i] = std::move(running);
+            running = std::move(next);
+        }
+        else
+        {
+            running = op(std::move(running), in[i]);
+            out[i] = running;
+        }
+    }
+    return running;
+}
+
+// Reduce-then-scan over fixed blocks: fold every block but the last in
+// parallel, scan the block folds serially into carries, then scan every block
+// in parallel starting from its carry. The input is read twice and the output
+// written once.
+template<bool Exclusive, typename T, typename InIt, typename OutIt, typename Op>
+OutIt Scan(Scheduler& scheduler, InIt first, InIt last, OutIt out, std::optional<T> init, Op& op)
+{
+    const std::size_t count = static_cast<std::size_t>(last - first);
+    if (count == 0)
+        return out;
+
+    // An inclusive scan without an initial value is seeded by the first element
+    std::size_t start = 0;
+    if (!init)
+    {
+        init.emplace(first[0]);
+        out[0] = *init;
+        start = 1;
+    }
+
+    const std::size_t remaining = count - start;
+    const Blocks layout = Blocks::For(remaining);
+    const std::size_t block = layout.size;
+    const std::size_t blocks = layout.count;
+    InIt in = first + start;
+    OutIt dest = out + start;
+
+    if (scheduler.WorkerCount() <= 1 || blocks <= 1)
+    {
+        ScanSequential<Exclusive>(in, dest, remaining, std::move(*init), op);
+        return out + count;
+    }
+
+    // carries[b] first holds the fold of block b - 1, then the value block b starts from
+    std::vector<std::optional<T>> carries(blocks);
+    ParallelFor(scheduler, std::size_t(1), blocks, [&](std::size_t b)
+    {
+        InIt blockIn = in + (b - 1) * block;
+        T acc = blockIn[0];
+        for (std::size_t i = 1; i < block; i++)
+            acc = op(std::move(acc), blockIn[i]);
+        carries[b].emplace(std::move(acc));
+    }, AutoPartitioner{ 1 });
+
+    carries[0] = std::move(init);
+    for (std::size_t b = 1; b < blocks; b++)
+        carries[b] = op(*carries[b - 1], std::move(*carries[b]));
+
+    ParallelFor(scheduler, std::size_t(0), blocks, [&](std::size_t b)
+    {
+        std::size_t offset = b * block;
+        std::size_t length = std::min(block, remaining - offset);
+        ScanSequential<Exclusive>(in + offset, dest + offset, length, std::move(*carries[b]), op);
+    }, AutoPartitioner{ 1 });
+
+    return out + count;
+}
+
+} // namespace detail
+
+// Parallel std::inclusive_scan: out[i] = first[0] op ... op first[i]. op must be
+// associative; floating-point results may differ in the last bits from a serial
+// scan. out may equal first. Returns the end of the output.
+template<std::random_access_iterator InIt, std::random_access_iterator OutIt, typename Op = std::plus<>>
+OutIt ParallelInclusiveScan(Scheduler& scheduler, InIt first, InIt last, OutIt out, Op op = {})
+{
+    using T = std::iter_value_t<InIt>;
+    return detail::Scan<false, T>(scheduler, first, last, out, std::optional<T>(), op);
+}
+
+// As above, with init folded in front of the first element
+template<std::random_access_iterator InIt, std::random_access_iterator OutIt, typename Op, typename T>
+OutIt ParallelInclusiveScan(Scheduler& scheduler, InIt first, InIt last, OutIt out, Op op, T init)
+{
+    return detail::Scan<false, T>(scheduler, first, last, out, std::optional<T>(std::move(init)), op);
+}
+
+// Parallel std::exclusive_scan: out[i] = init op first[0] op ... op first[i - 1].
+// Same requirements as ParallelInclusiveScan.
+template<std::random_access_iterator InIt, std::random_access_iterator OutIt, typename T, typename Op = std::plus<>>
+OutIt ParallelExclusiveScan(Scheduler& scheduler, InIt first, InIt last, OutIt out, T init, Op op = {})
+{
+    return detail::Scan<true, T>(scheduler, first, last, out, std::optional<T>(std::move(init)), op);
+}
+
+namespace detail {
+
+// Merges two sorted ranges into out by moving. Large merges split the bigger
+// range at its middle, binary search the split point in the other and merge
+// both halves in parallel. Ties keep elements of the first range first.
+template<typename InIt, typename OutIt, typename Compare>
+void ParallelMerge(Scheduler& scheduler, InIt first1, InIt last1, InIt first2, InIt last2, OutIt out, Compare& comp)
+{
+    constexpr std::ptrdiff_t MergeCutoff = 8192;
+
+    const std::ptrdiff_t size1 = last1 - first1;
+    const std::ptrdiff_t size2 = last2 - first2;
+    if (size1 + size2 <= MergeCutoff)
+    {
+        std::merge(std::make_move_iterator(first1), std::make_move_iterator(last1),
+            std::make_move_iterator(first2), std::make_move_iterator(last2), out, comp);
+        return;
+    }
+
+    InIt middle1, middle2;
+    if (size1 >= size2)
+    {
+        middle1 = first1 + size1 / 2;
+        middle2 = std::lower_bound(first2, last2, *middle1, comp);
+    }
+    else
+    {
+        middle2 = first2 + size2 / 2;
+        middle1 = std::upper_bound(first1, last1, *middle2, comp);
+    }
+    OutIt outMiddle = out + (middle1 - first1) + (middle2 - first2);
+
+    TaskGroup group(scheduler);
+    group.Run([&]() { ParallelMerge(scheduler, first1, middle1, first2, middle2, out, comp); });
+    ParallelMerge(scheduler, middle1, last1, middle2, last2, outMiddle, comp);
+    group.Wait();
+}
+
+// Sorts count elements at data, leaving the result at buffer if intoBuffer and
+// at data otherwise. Halves are sorted in parallel into the opposite side and
+// merged back, so every level moves the elements exactly once.
+template<bool Stable, typename DataIt, typename BufferIt, typename Compare>
+void MergeSort(Scheduler& scheduler, DataIt data, BufferIt buffer, std::size_t count, bool intoBuffer, Compare& comp, std::size_t leaf)
+{
+    if (count <= leaf)
+    {
+        if constexpr (Stable)
+            std::stable_sort(data, data + count, comp);
+        else
+            std::sort(data, data + count, comp);
+        if (intoBuffer)
+            std::move(data, data + count, buffer);
+        return;
+    }
+
+    const std::size_t half = count / 2;
+    {
+        TaskGroup group(scheduler);
+        group.Run([&]() { MergeSort<Stable>(scheduler, data, buffer, half, !intoBuffer, comp, leaf); });
+        MergeSort<Stable>(scheduler, data + half, buffer + half, count - half, !intoBuffer, comp, leaf);
+        group.Wait();
+    }
+
+    if (intoBuffer)
+        ParallelMerge(scheduler, data, data + half, data + half, data + count, buffer, comp);
+    else
+        ParallelMerge(scheduler, buffer, buffer + half, buffer + half, buffer + count, data, comp);
+}
+
+template<bool Stable, typename It, typename Compare>
+void Sort(Scheduler& scheduler, It first, It last, Compare& comp)
+{
+    using T = std::iter_value_t<It>;
+
+    // Leaves are sized to stay in a typical L2 cache but still give every
+    // worker a few of them
+    constexpr std::size_t LeafBytes = 256 * 1024;
+    constexpr std::size_t MinLeafSize = 1024;
+
+    const std::size_t count = static_cast<std::size_t>(last - first);
+    const std::size_t workers = scheduler.WorkerCount();
+    const std::size_t leaf = std::max(MinLeafSize, std::min(LeafBytes / sizeof(T), count / (workers * 4)));
+
+    if (workers <= 1 || count <= leaf)
+    {
+        if constexpr (Stable)
+            std::stable_sort(first, last, comp);
+        else
+            std::sort(first, last, comp);
+        return;
+    }
+
+    // The elements move into the buffer first, so the sort finishes back in place
+    std::vector<T> buffer(std::make_move_iterator(first), std::make_move_iterator(last));
+    MergeSort<Stable>(scheduler, buffer.begin(), first, count, true, comp, leaf);
+}
+
+} // namespace detail
+
+// Parallel mergesort. Halves are sorted and merged as jobs, and waiting
+// threads help instead of blocking, so calling it from inside a job adds no
+// threads. Needs a temporary buffer the size of the range.
+template<std::random_access_iterator It, typename Compare = std::less<>>
+void ParallelSort(Scheduler& scheduler, It first, It last, Compare comp = {})
+{
+    detail::Sort<false>(scheduler, first, last, comp);
+}
+
+// As ParallelSort, but equal elements keep their relative order
+template<std::random_access_iterator It, typename Compare = std::less<>>
+void ParallelStableSort(Scheduler& scheduler, It first, It last, Compare comp = {})
+{
+    detail::Sort<true>(scheduler, first, last, comp);
+}
+
+// Parallel std::copy_if, keeping the input order. Blocks count their matches,
+// the counts are scanned into output offsets and each block then copies its
+// matches to its own offset. pred is called twice per element and must give
+// the same answer both times. Returns the end of the output.
+template<std::random_access_iterator InIt, std::random_access_iterator OutIt, typename Pred>
+OutIt ParallelCopyIf(Scheduler& scheduler, InIt first, InIt last, OutIt out, Pred pred)
+{
+    const std::size_t count = static_cast<std::size_t>(last - first);
+    const detail::Blocks layout = detail::Blocks::For(count);
+    const std::size_t block = layout.size;
+    const std::size_t blocks = layout.count;
+    if (scheduler.WorkerCount() <= 1 || blocks <= 1)
+        return std::copy_if(first, last, out, pred);
+
+    // offsets[b + 1] holds the match count of block b until the scan below
+    std::vector<std::size_t> offsets(blocks + 1, 0);
+    ParallelFor(scheduler, std::size_t(0), blocks, [&](std::size_t b)
+    {
+        InIt begin = first + b * block;
+        offsets[b + 1] = std::count_if(begin, begin + std::min(block, count - b * block), std::ref(pred));
+    }, AutoPartitioner{ 1 });
+
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    ParallelFor(scheduler, std::size_t(0), blocks, [&](std::size_t b)
+    {
+        InIt begin = first + b * block;
+        std::copy_if(begin, begin + std::min(block, count - b * block), out + offsets[b], std::ref(pred));
+    }, AutoPartitioner{ 1 });
+
+    return out + offsets.back();
+}
+
+// Parallel std::stable_partition: elements satisfying pred move to the front,
+// both groups keep their order. The range is moved into a temporary buffer,
+// blocks count their matches, and each block scatters its elements straight to
+// their final positions. pred is called twice per element. Returns the start
+// of the second group.
+template<std::random_access_iterator It, typename Pred>
+It ParallelPartition(Scheduler& scheduler, It first, It last, Pred pred)
+{
+    using T = std::iter_value_t<It>;
+
+    const std::size_t count = static_cast<std::size_t>(last - first);
+    const detail::Blocks layout = detail::Blocks::For(count);
+    const std::size_t block = layout.size;
+    const std::size_t blocks = layout.count;
+    if (scheduler.WorkerCount() <= 1 || blocks <= 1)
+        return std::stable_partition(first, last, pred);
+
+    std::vector<T> buffer(std::make_move_iterator(first), std::make_move_iterator(last));
+
+    // matches[b] becomes the number of matches before block b
+    std::vector<std::size_t> matches(blocks + 1, 0);
+    ParallelFor(scheduler, std::size_t(0), blocks, [&](std::size_t b)
+    {
+        auto begin = buffer.begin() + b * block;
+        matches[b + 1] = std::count_if(begin, begin + std::min(block, count - b * block), std::ref(pred));
+    }, AutoPartitioner{ 1 });
+
+    std::partial_sum(matches.begin(), matches.end(), matches.begin());
+    const std::size_t totalMatches = matches.back();
+
+    ParallelFor(scheduler, std::size_t(0), blocks, [&](std::size_t b)
+    {
+        auto begin = buffer.begin() + b * block;
+        auto end = begin + std::min(block, count - b * block);
+        It matched = first + matches[b];
+        It rest = first + totalMatches + (b * block - matches[b]);
+        for (auto it = begin; it != end; ++it)
+        {
+            if (pred(*it))
+                *matched++ = std::move(*it);
+            else
+                *rest++ = std::move(*it);
+        }
+    }, AutoPartitioner{ 1 });
+
+    return first + totalMatches;
+}
+
+namespace detail {
+
+// Index of a match in [first, first + count), or count if there is none. With
+// FindFirst it is the lowest matching index, otherwise any one. Ranges are
+// handed out front to back and the shared result doubles as the stop flag:
+// unstarted ranges see it and return at once, running ones check it every
+// StopCheckInterval elements.
+template<bool FindFirst, typename It, typename Pred>
+std::size_t FindIndex(Scheduler& scheduler, It first, std::size_t count, Pred& pred)
+{
+    constexpr std::size_t StopCheckInterval = 256;
+
+    const std::size_t grain = std::clamp<std::size_t>(count / (scheduler.WorkerCount() * 16), 1024, 65536);
+    std::atomic<std::size_t> result{ count };
+
+    ParallelFor(scheduler, std::size_t(0), count, [&](std::size_t begin, std::size_t end)
+    {
+        for (std::size_t chunk = begin; chunk < end; chunk += StopCheckInterval)
+        {
+            std::size_t found = result.load(std::memory_order_relaxed);
+            if (FindFirst ? found <= chunk : found != count)
+                return;
+
+            const std::size_t chunkEnd = std::min(chunk + StopCheckInterval, end);
+            for (std::size_t i = chunk; i < chunkEnd; i++)
+            {
+                if (!pred(first[i]))
+                    continue;
+
+                if constexpr (FindFirst)
+                {
+                    while (i < found && !result.compare_exchange_weak(found, i, std::memory_order_relaxed))
+                    {
+                    }
+                }
+                else
+                {
+                    result.store(i, std::memory_order_relaxed);
+                }
+                return;
+            }
+        }
+    }, DynamicPartitioner{ grain });
+
+    return result.load(std::memory_order_relaxed);
+}
+
+} // namespace detail
+
+// Parallel std::find_if: the first element satisfying pred, or last. Once a
+// match is known, ranges after it are skipped and running ones stop shortly
+// after; other jobs on the scheduler are unaffected.
+template<std::random_access_iterator It, typename Pred>
+It ParallelFindIf(Scheduler& scheduler, It first, It last, Pred pred)
+{
+    return first + detail::FindIndex<true>(scheduler, first, static_cast<std::size_t>(last - first), pred);
+}
+
+// Parallel std::any_of. Stops all ranges as soon as any match is found.
+template<std::random_access_iterator It, typename Pred>
+bool ParallelAnyOf(Scheduler& scheduler, It first, It last, Pred pred)
+{
+    const std::size_t count = static_cast<std::size_t>(last - first);
+    return detail::FindIndex<false>(scheduler, first, count, pred) != count;
+}
+
+// Memory held by a ParallelGroupBy call, in bytes of slot storage
+struct GroupByStats
+{
+    std::size_t partitions = 0;
+    std::size_t localTableBytes = 0;  // all per-worker tables, freed as partitions merge
+    std::size_t mergedTableBytes = 0; // all per-partition merge tables
+    std::size_t resultBytes = 0;      // the returned groups
+};
+
+template<typename Key, typename Value>
+struct GroupByResult
+{
+    std::vector<std::pair<Key, Value>> groups;
+    GroupByStats stats;
+};
+
+namespace detail {
+
+// MurmurHash3 finalizer. Standard hashes may be the identity, and the
+// partition comes from the top bits and the table slot from the bottom ones.
+inline std::uint64_t MixHash(std::uint64_t hash) noexcept
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Open-addressing hash table with linear probing, kept at most half full.
+// Values for equal keys are folded together with combine.
+template<typename Key, typename Value>
+class FlatTable
+{
+public:
+    struct Slot
+    {
+        Key key;
+        Value value;
+        std::uint64_t hash;
+        bool used;
+    };
+
+    void Reserve(std::size_t count)
+    {
+        std::size_t capacity = 16;
+        while (capacity < count * 2)
+            capacity *= 2;
+        if (capacity > m_Slots.size())
+            Rehash(capacity);
+    }
+
+    template<typename KeyEqual, typename Combine>
+    void Add(std::uint64_t hash, Key&& key, Value&& value, KeyEqual& equal, Combine& combine)
+    {
+        if ((m_Size + 1) * 2 > m_Slots.size())
+            Rehash(std::max<std::size_t>(16, m_Slots.size() * 2));
+
+        const std::size_t mask = m_Slots.size() - 1;
+        for (std::size_t i = hash & mask;; i = (i + 1) & mask)
+        {
+            Slot& slot = m_Slots[i];
+            if (!slot.used)
+            {
+                slot.key = std::move(key);
+                slot.value = std::move(value);
+                slot.hash = hash;
+                slot.used = true;
+                m_Size++;
+                return;
+            }
+            if (slot.hash == hash && equal(slot.key, key))
+            {
+                slot.value = combine(std::move(slot.value), std::move(value));
+                return;
+            }
+        }
+    }
+
+    std::size_t Size() const noexcept
+    {
+        return m_Size;
+    }
+
+    std::size_t Bytes() const noexcept
+    {
+        return m_Slots.capacity() * sizeof(Slot);
+    }
+
+    std::vector<Slot>& Slots() noexcept
+    {
+        return m_Slots;
+    }
+
+    void Release() noexcept
+    {
+        std::vector<Slot>().swap(m_Slots);
+        m_Size = 0;
+    }
+
+private:
+    void Rehash(std::size_t capacity)
+    {
+        std::vector<Slot> old = std::exchange(m_Slots, std::vector<Slot>(capacity));
+        const std::size_t mask = capacity - 1;
+        for (Slot& slot : old)
+        {
+            if (!slot.used)
+                continue;
+            std::size_t i = slot.hash & mask;
+            while (m_Slots[i].used)
+                i = (i + 1) & mask;
+            m_Slots[i] = std::move(slot);
+        }
+    }
+
+    std::vector<Slot> m_Slots;
+    std::size_t m_Size = 0;
+};
+
+} // namespace detail
+
+// Groups the elements of [first, last) by keyFn(element) and folds
+// valueFn(element) of each group with combine, which must be associative and
+// commutative. Every worker aggregates into its own tables, one per hash
+// partition, without locks; partitions are then merged in parallel and
+// written out as one flat vector, in no particular order. Key and Value must
+// be default constructible.
+template<std::random_access_iterator It, typename KeyFn, typename ValueFn, typename Combine,
+    typename Hash = std::hash<std::decay_t<std::invoke_result_t<KeyFn&, std::iter_reference_t<It>>>>,
+    typename KeyEqual = std::equal_to<>>
+auto ParallelGroupBy(Scheduler& scheduler, It first, It last, KeyFn keyFn, ValueFn valueFn, Combine combine,
+    Hash hash = {}, KeyEqual equal = {})
+{
+    using Key = std::decay_t<std::invoke_result_t<KeyFn&, std::iter_reference_t<It>>>;
+    using Value = std::decay_t<std::invoke_result_t<ValueFn&, std::iter_reference_t<It>>>;
+    using Table = detail::FlatTable<Key, Value>;
+
+    // A few partitions per worker, a power of two so the top hash bits pick one
+    std::size_t partitionBits = 4;
+    while ((std::size_t(1) << partitionBits) < scheduler.WorkerCount() * 4 && partitionBits < 8)
+        partitionBits++;
+    const std::size_t partitions = std::size_t(1) << partitionBits;
+
+    // One set of partition tables per worker, plus one for the calling thread
+    std::vector<detail::CachePadded<std::vector<Table>>> local(scheduler.WorkerCount() + 1);
+    for (auto& tables : local)
+        tables.value.resize(partitions);
+
+    ParallelFor(scheduler, std::size_t(0), static_cast<std::size_t>(last - first), [&](std::size_t begin, std::size_t end)
+    {
+        std::vector<Table>& tables = local[scheduler.CurrentWorkerIndex() + 1].value;
+        for (std::size_t i = begin; i < end; i++)
+        {
+            Key key = keyFn(first[i]);
+            std::uint64_t mixed = detail::MixHash(static_cast<std::uint64_t>(hash(key)));
+            tables[mixed >> (64 - partitionBits)].Add(mixed, std::move(key), valueFn(first[i]), equal, combine);
+        }
+    });
+
+    GroupByResult<Key, Value> result;
+    result.stats.partitions = partitions;
+    for (auto& tables : local)
+        for (Table& table : tables.value)
+            result.stats.localTableBytes += table.Bytes();
+
+    // Merge each partition across workers; offsets[p + 1] starts as its group count
+    std::vector<Table> merged(partitions);
+    std::vector<std::size_t> offsets(partitions + 1, 0);
+    ParallelFor(scheduler, std::size_t(0), partitions, [&](std::size_t p)
+    {
+        // The largest worker table is a lower bound on the partition's group count
+        std::size_t largest = 0;
+        for (auto& tables : local)
+            largest = std::max(largest, tables.value[p].Size());
+        merged[p].Reserve(largest);
+
+        for (auto& tables : local)
+        {
+            Table& table = tables.value[p];
+            for (auto& slot : table.Slots())
+                if (slot.used)
+                    merged[p].Add(slot.hash, std::move(slot.key), std::move(slot.value), equal, combine);
+            table.Release();
+        }
+        offsets[p + 1] = merged[p].Size();
+    }, AutoPartitioner{ 1 });
+
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    for (Table& table : merged)
+        result.stats.mergedTableBytes += table.Bytes();
+
+    result.groups.resize(offsets.back());
+    ParallelFor(scheduler, std::size_t(0), partitions, [&](std::size_t p)
+    {
+        auto out = result.groups.begin() + offsets[p];
+        for (auto& slot : merged[p].Slots())
+            if (slot.used)
+                *out++ = { std::move(slot.key), std::move(slot.value) };
+        merged[p].Release();
+    }, AutoPartitioner{ 1 });
+
+    result.stats.resultBytes = result.groups.capacity() * sizeof(std::pair<Key, Value>);
+    return result;
+}
+
+// Tile extents for ParallelFor2D / ParallelFor3D. x is the innermost
+// (fastest varying) dimension. A 0 extent is picked automatically.
+struct Tile2D
+{
+    std::size_t width = 0;
+    std::size_t height = 0;
+};
+
+struct Tile3D
+{
+    std::size_t width = 0;
+    std::size_t height = 0;
+    std::size_t depth = 0;
+};
+
+namespace detail {
+
+// Spreads the low 32 bits of v so one zero bit follows each
+inline std::uint64_t SpreadBits2(std::uint64_t v) noexcept
+{
+    v &= 0xffffffffULL;
+    v = (v | (v << 16)) & 0x0000ffff0000ffffULL;
+    v = (v | (v << 8)) & 0x00ff00ff00ff00ffULL;
+    v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    v = (v | (v << 2)) & 0x3333333333333333ULL;
+    v = (v | (v << 1)) & 0x5555555555555555ULL;
+    return v;
+}
+
+inline std::uint64_t CompactBits2(std::uint64_t v) noexcept
+{
+    v &= 0x5555555555555555ULL;
+    v = (v | (v >> 1)) & 0x3333333333333333ULL;
+    v = (v | (v >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+    v = (v | (v >> 4)) & 0x00ff00ff00ff00ffULL;
+    v = (v | (v >> 8)) & 0x0000ffff0000ffffULL;
+    v = (v | (v >> 16)) & 0x00000000ffffffffULL;
+    return v;
+}
+
+// Spreads the low 21 bits of v so two zero bits follow each
+inline std::uint64_t SpreadBits3(std::uint64_t v) noexcept
+{
+    v &= 0x1fffffULL;
+    v = (v | (v << 32)) & 0x001f00000000ffffULL;
+    v = (v | (v << 16)) & 0x001f0000ff0000ffULL;
+    v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+    v = (v | (v << 2)) & 0x1249249249249249ULL;
+    return v;
+}
+
+inline std::uint64_t CompactBits3(std::uint64_t v) noexcept
+{
+    v &= 0x1249249249249249ULL;
+    v = (v | (v >> 2)) & 0x10c30c30c30c30c3ULL;
+    v = (v | (v >> 4)) & 0x100f00f00f00f00fULL;
+    v = (v | (v >> 8)) & 0x001f0000ff0000ffULL;
+    v = (v | (v >> 16)) & 0x001f00000000ffffULL;
+    v = (v | (v >> 32)) & 0x1fffffULL;
+    return v;
+}
+
+// Picks tile extents for the auto (0) dimensions: 64x64 or 16x16x16 iterations,
+// small enough for the touched data to stay in L1/L2 for typical element
+// sizes, then halves the largest extent until every worker gets a few tiles
+template<std::size_t N>
+std::array<std::size_t, N> PickTile(const std::array<std::size_t, N>& extent, std::array<std::size_t, N> tile, std::size_t workers)
+{
+    constexpr std::size_t DefaultExtent = N == 2 ? 64 : 16;
+    constexpr std::size_t MinTileIterations = 256;
+
+    std::array<bool, N> automatic{};
+    for (std::size_t d = 0; d < N; d++)
+    {
+        automatic[d] = tile[d] == 0;
+        tile[d] = std::min(extent[d], automatic[d] ? DefaultExtent : tile[d]);
+    }
+
+    for (;;)
+    {
+        std::size_t tiles = 1, iterations = 1, largest = N;
+        for (std::size_t d = 0; d < N; d++)
+        {
+            tiles *= (extent[d] + tile[d] - 1) / tile[d];
+            iterations *= tile[d];
+            if (automatic[d] && tile[d] > 1 && (largest == N || tile[d] > tile[largest]))
+                largest = d;
+        }
+        if (tiles >= workers * 4 || iterations <= MinTileIterations || largest == N)
+            return tile;
+        tile[largest] = (tile[largest] + 1) / 2;
+    }
+}
+
+// Runs body over the tiles of an N-dimensional box in Morton (Z) order, so a
+// contiguous run of tiles, which is what one worker takes, stays compact.
+// The tile codes are sorted once per call; the grid need not be a square
+// power of two.
+template<std::size_t N, typename Index, typename TileBody>
+void ForEachTile(Scheduler& scheduler, const std::array<Index, N>& begin, const std::array<Index, N>& end,
+    std::array<std::size_t, N> tile, TileBody& tileBody)
+{
+    std::array<std::size_t, N> extent{}, tiles{};
+    std::size_t tileCount = 1;
+    for (std::size_t d = 0; d < N; d++)
+    {
+        if (!(begin[d] < end[d]))
+            return;
+        extent[d] = static_cast<std::size_t>(end[d] - begin[d]);
+    }
+
+    tile = PickTile<N>(extent, tile, scheduler.WorkerCount());
+    for (std::size_t d = 0; d < N; d++)
+    {
+        tiles[d] = (extent[d] + tile[d] - 1) / tile[d];
+        tileCount *= tiles[d];
+    }
+
+    auto encode = [](std::size_t d, std::size_t v) { return (N == 2 ? SpreadBits2(v) : SpreadBits3(v)) << d; };
+    auto decode = [](std::size_t d, std::uint64_t code) { return static_cast<std::size_t>(N == 2 ? CompactBits2(code >> d) : CompactBits3(code >> d)); };
+
+    std::vector<std::uint64_t> codes;
+    codes.reserve(tileCount);
+    std::array<std::size_t, N> position{};
+    for (std::size_t i = 0; i < tileCount; i++)
+    {
+        std::uint64_t code = 0;
+        for (std::size_t d = 0; d < N; d++)
+            code |= encode(d, position[d]);
+        codes.push_back(code);
+
+        for (std::size_t d = 0; d < N && ++position[d] == tiles[d]; d++)
+            position[d] = 0;
+    }
+    std::sort(codes.begin(), codes.end());
+
+    ParallelFor(scheduler, std::size_t(0), tileCount, [&](std::size_t first, std::size_t last)
+    {
+        for (std::size_t i = first; i < last; i++)
+        {
+            std::array<Index, N> tileBegin, tileEnd;
+            for (std::size_t d = 0; d < N; d++)
+            {
+                std::size_t offset = decode(d, codes[i]) * tile[d];
+                tileBegin[d] = begin[d] + static_cast<Index>(offset);
+                tileEnd[d] = begin[d] + static_cast<Index>(std::min(offset + tile[d], extent[d]));
+            }
+            tileBody(tileBegin, tileEnd);
+        }
+    }, AutoPartitioner{ 1 });
+}
+
+} // namespace detail
+
+// Calls body(x, y) for every point of [beginX, endX) x [beginY, endY), or
+// body(x0, x1, y0, y1) once per tile if the body takes four indices. Tiles are
+// cache-sized (or the given extents) and handed to workers in Morton order.
+template<std::integral Index, typename Body>
+void ParallelFor2D(Scheduler& scheduler, Index beginX, Index endX, Index beginY, Index endY, Body&& body, Tile2D tile = {})
+{
+    auto tileBody = [&](const std::array<Index, 2>& first, const std::array<Index, 2>& last)
+    {
+        if constexpr (std::is_invocable_v<Body&, Index, Index, Index, Index>)
+        {
+            body(first[0], last[0], first[1], last[1]);
+        }
+        else
+        {
+            for (Index y = first[1]; y < last[1]; ++y)
+                for (Index x = first[0]; x < last[0]; ++x)
+                    body(x, y);
+        }
+    };
+    detail::ForEachTile<2, Index>(scheduler, { beginX, beginY }, { endX, endY }, { tile.width, tile.height }, tileBody);
+}
+
+// 3D version: body(x, y, z) per point or body(x0, x1, y0, y1, z0, z1) per tile
+template<std::integral Index, typename Body>
+void ParallelFor3D(Scheduler& scheduler, Index beginX, Index endX, Index beginY, Index endY, Index beginZ, Index endZ,
+    Body&& body, Tile3D tile = {})
+{
+    auto tileBody = [&](const std::array<Index, 3>& first, const std::array<Index, 3>& last)
+    {
+        if constexpr (std::is_invocable_v<Body&, Index, Index, Index, Index, Index, Index>)
+        {
+            body(first[0], last[0], first[1], last[1], first[2], last[2]);
+        }
+        else
+        {
+            for (Index z = first[2]; z < last[2]; ++z)
+                for (Index y = first[1]; y < last[1]; ++y)
+                    for (Index x = first[0]; x < last[0]; ++x)
+                        body(x, y, z);
+        }
+    };
+    detail::ForEachTile<3, Index>(scheduler, { beginX, beginY, beginZ }, { endX, endY, endZ }, { tile.width, tile.height, tile.depth }, tileBody);
+}
 
 } // namespace taskori
 